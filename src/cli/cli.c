@@ -2,6 +2,7 @@
 
 #include <libusb.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../core/hyperhotp.h"
@@ -23,12 +24,93 @@ CLIConfig cli_parse(const int argc, const char* argv[]) {
         conf.action = CLI_ACTION_RESET;
     } else if (strncmp(argv[1], "program", 100) == 0) {
         conf.action = CLI_ACTION_PROGRAM;
+    } else if (strncmp(argv[1], "reprogram", 100) == 0) {
+        conf.action = CLI_ACTION_REPROGRAM;
+    } else if (strncmp(argv[1], "list", 100) == 0) {
+        conf.action = CLI_ACTION_LIST;
+    } else if (strncmp(argv[1], "watch", 100) == 0) {
+        conf.action = CLI_ACTION_WATCH;
+    } else if (strncmp(argv[1], "script", 100) == 0) {
+        conf.action = CLI_ACTION_SCRIPT;
+    } else if (strncmp(argv[1], "manifest", 100) == 0) {
+        conf.action = CLI_ACTION_MANIFEST;
+    } else if (strncmp(argv[1], "codes", 100) == 0) {
+        conf.action = CLI_ACTION_CODES;
+    } else if (strncmp(argv[1], "wink", 100) == 0) {
+        conf.action = CLI_ACTION_WINK;
+    } else if (strncmp(argv[1], "lock", 100) == 0) {
+        conf.action = CLI_ACTION_LOCK;
     } else {
         conf.action = CLI_ACTION_INVALID;
     }
 
+    // Get script to run, "-" being stdin
+    if (conf.action == CLI_ACTION_SCRIPT) {
+        if (argc > 3) {
+            conf.action = CLI_ACTION_INVALID;
+        } else if (argc == 3 && strncmp(argv[2], "-", 100) != 0) {
+            conf.script_path = argv[2];
+        }
+        return conf;
+    }
+
+    // Get manifest format and file to read, "-" being stdin
+    if (conf.action == CLI_ACTION_MANIFEST) {
+        if (argc < 3 || argc > 4 || manifest_format_from_string(argv[2], &conf.manifest_format) != 0) {
+            conf.action = CLI_ACTION_INVALID;
+        } else if (argc == 4 && strncmp(argv[3], "-", 100) != 0) {
+            conf.manifest_path = argv[3];
+        }
+        return conf;
+    }
+
+    // Get seed to compute codes for, and how many
+    if (conf.action == CLI_ACTION_CODES) {
+        int arg_offset = 2;
+        if (argc > arg_offset && strncmp(argv[arg_offset], "-8", 100) == 0) {
+            conf.is_8_char_code = true;
+            arg_offset++;
+        } else if (argc > arg_offset && strncmp(argv[arg_offset], "-6", 100) == 0) {
+            arg_offset++;
+        }
+        if (argc <= arg_offset || argc > arg_offset + 2 || strlen(argv[arg_offset]) != HYPERHOTP_SEED_LEN_ASCII) {
+            conf.action = CLI_ACTION_INVALID;
+            return conf;
+        }
+        strncpy(conf.seed, argv[arg_offset], HYPERHOTP_SEED_LEN_ASCII);
+        arg_offset++;
+
+        conf.code_count = CLI_DEFAULT_CODE_COUNT;
+        if (argc > arg_offset) {
+            char* end = NULL;
+            const long count = strtol(argv[arg_offset], &end, 10);
+            if (end == argv[arg_offset] || *end != '\0' || count < 1 || count > CLI_MAX_CODE_COUNT) {
+                conf.action = CLI_ACTION_INVALID;
+                return conf;
+            }
+            conf.code_count = (uint32_t)count;
+        }
+        return conf;
+    }
+
+    // Get how long to lock for
+    if (conf.action == CLI_ACTION_LOCK) {
+        if (argc != 3) {
+            conf.action = CLI_ACTION_INVALID;
+            return conf;
+        }
+        char* end = NULL;
+        const long seconds = strtol(argv[2], &end, 10);
+        if (end == argv[2] || *end != '\0' || seconds < 0 || seconds > U2FHID_MAX_LOCK_SECONDS) {
+            conf.action = CLI_ACTION_INVALID;
+            return conf;
+        }
+        conf.lock_seconds = (uint8_t)seconds;
+        return conf;
+    }
+
     // Get arguments for programming
-    if (conf.action == CLI_ACTION_PROGRAM) {
+    if (conf.action == CLI_ACTION_PROGRAM || conf.action == CLI_ACTION_REPROGRAM) {
         // We need everything to be specified
         // If not, assume the default key length (6 bytes)
         bool have_explicit_length = false;
@@ -78,7 +160,60 @@ CLIConfig cli_parse(const int argc, const char* argv[]) {
     return conf;
 }
 
+CLIConfig cli_parse_script_line(char* line) {
+    // Strip comments
+    char* comment = strchr(line, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+
+    // Split into words, with a dummy binary name in front so that it can be parsed like the command line
+    const char* args[6] = {"script"};
+    int argc = 1;
+    for (char* word = strtok(line, " \t\r\n"); word != NULL; word = strtok(NULL, " \t\r\n")) {
+        if (argc == sizeof(args) / sizeof(args[0])) {
+            CLIConfig conf = {0};
+            conf.action = CLI_ACTION_INVALID;
+            return conf;
+        }
+        args[argc] = word;
+        argc++;
+    }
+    if (argc == 1) {
+        CLIConfig conf = {0};
+        conf.action = CLI_ACTION_HELP;
+        return conf;
+    }
+    if (argc == 2 && strncmp(args[1], "stats", 100) == 0) {
+        CLIConfig conf = {0};
+        conf.action = CLI_ACTION_STATS;
+        return conf;
+    }
+
+    CLIConfig conf = cli_parse(argc, args);
+    // Only commands operating on the device make sense in a script
+    switch (conf.action) {
+        case CLI_ACTION_CHECK:
+        case CLI_ACTION_RESET:
+        case CLI_ACTION_PROGRAM:
+        case CLI_ACTION_REPROGRAM:
+        case CLI_ACTION_WINK:
+        case CLI_ACTION_LOCK:
+            break;
+        default:
+            conf.action = CLI_ACTION_INVALID;
+            break;
+    }
+    return conf;
+}
+
 void cli_print_help(const char* binary_path) {
-    fprintf(stderr, "Usage: %s [help|check|reset|program] [-68] <8-character serial number> <40-character hex seed>\n",
+    fprintf(stderr,
+            "Usage: %s [help|list|watch|check|reset|wink|program|reprogram] [-68] <8-character serial number> "
+            "<40-character hex seed>\n",
             binary_path);
+    fprintf(stderr, "       %s lock <seconds, 0-10>\n", binary_path);
+    fprintf(stderr, "       %s script [<file>|-]\n", binary_path);
+    fprintf(stderr, "       %s manifest <hex|base32|raw> [<file>|-]\n", binary_path);
+    fprintf(stderr, "       %s codes [-68] <40-character hex seed> [<count>]\n", binary_path);
 }
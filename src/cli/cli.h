@@ -1,8 +1,10 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "../core/hyperhotp.h"
+#include "../core/manifest.h"
 
 typedef enum {
     CLI_ACTION_INVALID,
@@ -10,15 +12,51 @@ typedef enum {
     CLI_ACTION_CHECK,
     CLI_ACTION_RESET,
     CLI_ACTION_PROGRAM,
+    CLI_ACTION_LIST,
+    CLI_ACTION_WATCH,
+    CLI_ACTION_SCRIPT,
+    CLI_ACTION_WINK,
+    CLI_ACTION_LOCK,
+    CLI_ACTION_REPROGRAM,
+    CLI_ACTION_MANIFEST,
+    CLI_ACTION_CODES,
+    // Only in scripts: Print the transfers and time taken by the previous command
+    CLI_ACTION_STATS,
 } CLIAction;
 
+// Codes printed by the codes command unless told otherwise, and the most it prints
+#define CLI_DEFAULT_CODE_COUNT 10
+#define CLI_MAX_CODE_COUNT     1000000
+// Codes computed at once
+#define CLI_CODE_CHUNK_LEN     64
+
+// Longest line accepted in a command script
+#define CLI_SCRIPT_MAX_LINE_LEN 256
+
 typedef struct {
     CLIAction action;
     char serial[HYPERHOTP_SERIAL_LEN];
     char seed[HYPERHOTP_SEED_LEN_ASCII];
     bool is_8_char_code;
+    // How long to lock the device for, 0 releases the lock
+    uint8_t lock_seconds;
+    // File to read commands from, NULL for stdin
+    const char* script_path;
+    // Seed manifest to check and convert to hex, NULL for stdin
+    const char* manifest_path;
+    ManifestFormat manifest_format;
+    // How many codes to print, starting from the first
+    uint32_t code_count;
 } CLIConfig;
 
 CLIConfig cli_parse(const int argc, const char* argv[]);
 
+/*
+ * Parse a line of a command script, which holds a single command operating on the device, with the same arguments as
+ * on the command line. The line is modified in the process.
+ * Blank lines and comments (starting with '#') are returned as CLI_ACTION_HELP, meaning there's nothing to do.
+ * Besides the commands operating on the device, scripts may contain "stats" (CLI_ACTION_STATS).
+ */
+CLIConfig cli_parse_script_line(char* line);
+
 void cli_print_help(const char* binary_path);
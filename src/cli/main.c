@@ -1,15 +1,116 @@
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "../core/deadline.h"
+#include "../core/hotp.h"
 #include "../core/hyperhotp.h"
 #include "../core/log.h"
+#include "../core/manifest.h"
+#include "../core/seed.h"
 #include "../core/u2fhid.h"
+#include "../core/usb.h"
 #include "cli.h"
 
-static void check(libusb_device_handle *handle, const FIDOCID cid) {
+// Deadline all device operations run under, cancelled on CTRL-C
+static Deadline DEADLINE;
+
+// How long watch gives a newly arrived key to answer, so that one that doesn't can't stall the ones after it
+#define WATCH_CHECK_TIMEOUT_MS 5000
+
+// Deadline of the check of a newly arrived key, also cancelled on CTRL-C
+static Deadline WATCH_CHECK_DEADLINE;
+
+static void on_sigint(int sig) {
+    (void)sig;
+    hyperhotp_cancel(&DEADLINE);
+    hyperhotp_cancel(&WATCH_CHECK_DEADLINE);
+}
+
+static void list(USBContext *ctx) {
+    USBDeviceInfo *devices = NULL;
+    size_t count = 0;
+    if (hyperhotp_enumerate(ctx, &devices, &count) != 0) {
+        char *err_str = log_get_last_error_string();
+        fprintf(stderr, "Failed to list devices, error message: %s\n", err_str);
+        log_free_error_string(err_str);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        char port_path[USB_PORT_PATH_STR_LEN] = {0};
+        usb_format_port_path(&devices[i], port_path, sizeof(port_path));
+        printf("%s: %04x:%04x (revision %x.%02x)\n", port_path, devices[i].vendor_id, devices[i].product_id,
+               devices[i].bcd_device >> 8, devices[i].bcd_device & 0xff);
+    }
+    if (count == 0) {
+        printf("No devices found\n");
+    }
+    hyperhotp_free_device_list(devices, count);
+}
+
+static void watch_arrived(USBDevice *dev, void *user_data) {
+    (void)user_data;
+    char port_path[USB_PORT_PATH_STR_LEN] = {0};
+    usb_format_port_path(&dev->info, port_path, sizeof(port_path));
+
+    FIDOCID cid;
     char serial[HYPERHOTP_SERIAL_LEN] = {0};
-    const int programmed = hyperhotp_check_programmed(handle, cid, serial);
+    int programmed = -1;
+    deadline_init(&WATCH_CHECK_DEADLINE, WATCH_CHECK_TIMEOUT_MS);
+    if (deadline_is_cancelled(&DEADLINE)) {
+        hyperhotp_cancel(&WATCH_CHECK_DEADLINE);
+    }
+    if (hyperhotp_alloc_channel(dev, cid, &WATCH_CHECK_DEADLINE) == 0) {
+        programmed = hyperhotp_check_programmed(dev, cid, serial, &WATCH_CHECK_DEADLINE);
+    }
+    if (programmed == 1) {
+        printf("%s: Device is programmed, serial: %.8s\n", port_path, serial);
+    } else if (programmed == 0) {
+        printf("%s: Device is not programmed\n", port_path);
+    } else {
+        char *err_str = log_get_last_error_string();
+        fprintf(stderr, "%s: Failed to check whether device is programmed, error message: %s\n", port_path, err_str);
+        log_free_error_string(err_str);
+    }
+    fflush(stdout);
+}
+
+static void watch_left(USBDevice *dev, void *user_data) {
+    (void)user_data;
+    char port_path[USB_PORT_PATH_STR_LEN] = {0};
+    usb_format_port_path(&dev->info, port_path, sizeof(port_path));
+    printf("%s: Device removed\n", port_path);
+    fflush(stdout);
+}
+
+static void watch(USBContext *ctx) {
+    USBHotplug *hotplug = NULL;
+    if (usb_hotplug_start(ctx, &hotplug, watch_arrived, watch_left, NULL) != 0) {
+        char *err_str = log_get_last_error_string();
+        fprintf(stderr, "Failed to watch for devices, error message: %s\n", err_str);
+        log_free_error_string(err_str);
+        exit(EXIT_FAILURE);
+    }
+    printf("Waiting for devices, press CTRL-C to stop\n");
+    fflush(stdout);
+    while (!deadline_is_cancelled(&DEADLINE)) {
+        if (usb_hotplug_poll(hotplug, 100) != 0) {
+            char *err_str = log_get_last_error_string();
+            fprintf(stderr, "Failed to watch for devices, error message: %s\n", err_str);
+            log_free_error_string(err_str);
+            usb_hotplug_stop(hotplug);
+            exit(EXIT_FAILURE);
+        }
+    }
+    usb_hotplug_stop(hotplug);
+}
+
+static int check(HyperhotpSession *session, USBDevice *dev) {
+    char serial[HYPERHOTP_SERIAL_LEN] = {0};
+    const int programmed = hyperhotp_session_check_programmed(session, dev, serial, &DEADLINE);
     if (programmed == 1) {
         printf("Device is programmed, serial: %.8s\n", serial);
     } else if (programmed == 0) {
@@ -18,31 +119,241 @@ static void check(libusb_device_handle *handle, const FIDOCID cid) {
         char *err_str = log_get_last_error_string();
         fprintf(stderr, "Failed to check whether device is programmed, error message: %s\n", err_str);
         log_free_error_string(err_str);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    return 0;
 }
 
-static void reset(libusb_device_handle *handle, const FIDOCID cid) {
-    if (hyperhotp_reset(handle, cid) == 0) {
+static int reset(HyperhotpSession *session, USBDevice *dev) {
+    if (hyperhotp_session_reset(session, dev, &DEADLINE) == 0) {
         printf("Reset complete!\n");
     } else {
         char *err_str = log_get_last_error_string();
         fprintf(stderr, "Failed to reset device, error message: %s\n", err_str);
         log_free_error_string(err_str);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    return 0;
 }
 
-static void program(libusb_device_handle *handle, const FIDOCID cid, const CLIConfig cfg) {
-    const int err = hyperhotp_program(handle, cid, cfg.is_8_char_code, cfg.serial, cfg.seed);
+static int program(HyperhotpSession *session, USBDevice *dev, const CLIConfig cfg) {
+    const int err = hyperhotp_session_program(session, dev, cfg.is_8_char_code, cfg.serial, cfg.seed, &DEADLINE);
     if (err != 0) {
         char *err_str = log_get_last_error_string();
         fprintf(stderr, "Failed to program device, error message: %s\n", err_str);
         log_free_error_string(err_str);
-        exit(EXIT_FAILURE);
+        return -1;
     } else {
         printf("Programming complete!\n");
     }
+    return 0;
+}
+
+static int reprogram(HyperhotpSession *session, USBDevice *dev, const CLIConfig cfg) {
+    const int err = hyperhotp_session_reprogram(session, dev, cfg.is_8_char_code, cfg.serial, cfg.seed, &DEADLINE);
+    if (err != 0) {
+        char *err_str = log_get_last_error_string();
+        fprintf(stderr, "Failed to reprogram device, error message: %s\n", err_str);
+        log_free_error_string(err_str);
+        return -1;
+    } else {
+        printf("Reprogramming complete!\n");
+    }
+    return 0;
+}
+
+static int wink(HyperhotpSession *session, USBDevice *dev) {
+    if (hyperhotp_session_wink(session, dev, &DEADLINE) != 0) {
+        char *err_str = log_get_last_error_string();
+        fprintf(stderr, "Failed to wink device, error message: %s\n", err_str);
+        log_free_error_string(err_str);
+        return -1;
+    }
+    return 0;
+}
+
+static int lock(HyperhotpSession *session, USBDevice *dev, const CLIConfig cfg) {
+    if (hyperhotp_session_lock(session, dev, cfg.lock_seconds, &DEADLINE) != 0) {
+        char *err_str = log_get_last_error_string();
+        fprintf(stderr, "Failed to lock device, error message: %s\n", err_str);
+        log_free_error_string(err_str);
+        return -1;
+    }
+    if (cfg.lock_seconds == 0) {
+        printf("Lock released\n");
+    } else {
+        printf("Device locked for %u seconds\n", (unsigned int)cfg.lock_seconds);
+    }
+    return 0;
+}
+
+static int run(HyperhotpSession *session, USBDevice *dev, const CLIConfig cfg) {
+    switch (cfg.action) {
+        case CLI_ACTION_CHECK:
+            return check(session, dev);
+        case CLI_ACTION_RESET:
+            return reset(session, dev);
+        case CLI_ACTION_PROGRAM:
+            return program(session, dev, cfg);
+        case CLI_ACTION_REPROGRAM:
+            return reprogram(session, dev, cfg);
+        case CLI_ACTION_WINK:
+            return wink(session, dev);
+        case CLI_ACTION_LOCK:
+            return lock(session, dev, cfg);
+        default:
+            log_fatal("Unknown CLI action, this is a bug");
+            return -1;
+    }
+}
+
+static void print_stats_row(const char *name, const HyperhotpStats *stats) {
+    printf("%-14s %9u %9u %6u %6u %10.3f %10.3f\n", name, (unsigned int)stats->exchanges,
+           (unsigned int)stats->transfers, (unsigned int)stats->bytes_sent, (unsigned int)stats->bytes_received,
+           (double)stats->host_us / 1000.0, (double)stats->device_us / 1000.0);
+}
+
+// Break the transfers and time taken by an operation down by step, leaving out the ones it skipped.
+static void print_stats(const HyperhotpOpStats *stats) {
+    printf("%-14s %9s %9s %6s %6s %10s %10s\n", "step", "exchanges", "transfers", "sent", "recv", "host ms",
+           "device ms");
+    for (size_t i = 0; i < HYPERHOTP_STEP_COUNT; i++) {
+        if (stats->steps[i].exchanges > 0) {
+            print_stats_row(hyperhotp_step_name((HyperhotpStep)i), &stats->steps[i]);
+        }
+    }
+    print_stats_row("total", &stats->total);
+}
+
+// Run commands read line by line, all on the same device and channel. Stops at the first one that fails.
+// The session saves the handshake and status query where a previous command already did them.
+static int script(HyperhotpSession *session, USBDevice *dev, const CLIConfig cfg) {
+    FILE *in = stdin;
+    if (cfg.script_path != NULL) {
+        in = fopen(cfg.script_path, "r");
+        if (in == NULL) {
+            fprintf(stderr, "Failed to open script %s\n", cfg.script_path);
+            return -1;
+        }
+    }
+    const char *name = cfg.script_path != NULL ? cfg.script_path : "<stdin>";
+
+    int result = 0;
+    HyperhotpOpStats stats = {0};
+    char line[CLI_SCRIPT_MAX_LINE_LEN];
+    size_t line_num = 0;
+    while (result == 0 && !deadline_is_cancelled(&DEADLINE) && fgets(line, sizeof(line), in) != NULL) {
+        line_num++;
+        if (strchr(line, '\n') == NULL && !feof(in)) {
+            fprintf(stderr, "%s:%zu: Line too long\n", name, line_num);
+            result = -1;
+            break;
+        }
+        const CLIConfig line_cfg = cli_parse_script_line(line);
+        if (line_cfg.action == CLI_ACTION_HELP) {
+            continue;
+        }
+        if (line_cfg.action == CLI_ACTION_STATS) {
+            print_stats(&stats);
+            continue;
+        }
+        if (line_cfg.action == CLI_ACTION_INVALID) {
+            fprintf(stderr, "%s:%zu: Invalid command\n", name, line_num);
+            result = -1;
+            break;
+        }
+        result = run(session, dev, line_cfg);
+        hyperhotp_get_last_stats(&stats);
+        fflush(stdout);
+        if (result != 0) {
+            const FIDOError error = hyperhotp_get_last_error();
+            fprintf(stderr, "%s:%zu: Command failed (%s%s), stopping\n", name, line_num, fido_error_string(error),
+                    fido_error_is_retryable(error) ? ", repeating it may help" : "");
+        }
+    }
+    if (ferror(in)) {
+        fprintf(stderr, "Failed to read script %s\n", name);
+        result = -1;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    return result;
+}
+
+// Print a seed from a manifest in the hex form taken by program, or why it isn't valid.
+static void manifest_seed(const uint8_t seed[SEED_LEN], const SeedStatus status, const size_t record, void *user_data) {
+    if (status != SEED_OK) {
+        fprintf(stderr, "%s:%zu: %s\n", (const char *)user_data, record, seed_status_string(status));
+        return;
+    }
+    static const char digits[] = "0123456789abcdef";
+    char line[SEED_LEN_ASCII + 1];
+    for (size_t i = 0; i < SEED_LEN; i++) {
+        line[2 * i] = digits[seed[i] >> 4];
+        line[2 * i + 1] = digits[seed[i] & 0xf];
+    }
+    line[SEED_LEN_ASCII] = '\n';
+    fwrite(line, 1, sizeof(line), stdout);
+}
+
+// Check a seed manifest, writing its seeds out as hex. Fails if any seed isn't valid.
+static int manifest(const CLIConfig cfg) {
+    FILE *in = stdin;
+    if (cfg.manifest_path != NULL) {
+        in = fopen(cfg.manifest_path, "rb");
+        if (in == NULL) {
+            fprintf(stderr, "Failed to open manifest %s\n", cfg.manifest_path);
+            return -1;
+        }
+    }
+    const char *name = cfg.manifest_path != NULL ? cfg.manifest_path : "<stdin>";
+
+    size_t num_seeds = 0;
+    size_t num_invalid = 0;
+    int result = manifest_parse_file(in, cfg.manifest_format, manifest_seed, (void *)name, &num_seeds, &num_invalid);
+    if (result != 0) {
+        char *err_str = log_get_last_error_string();
+        fprintf(stderr, "Failed to read manifest %s, error message: %s\n", name, err_str);
+        log_free_error_string(err_str);
+    } else if (num_invalid > 0) {
+        fprintf(stderr, "%s: %zu of %zu seeds aren't valid\n", name, num_invalid, num_seeds);
+        result = -1;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    return result;
+}
+
+// Print the first codes a key programmed with the seed will show, to check them against the key.
+static int codes(const CLIConfig cfg) {
+    uint8_t seed[SEED_LEN];
+    if (seed_decode(cfg.seed, seed) != 0) {
+        fprintf(stderr, "Seed contains non-hex characters\n");
+        return -1;
+    }
+    const unsigned int digits = hotp_digits(cfg.is_8_char_code);
+    // Computed a chunk at a time, in parallel
+    uint8_t keys[CLI_CODE_CHUNK_LEN][SEED_LEN];
+    uint64_t counters[CLI_CODE_CHUNK_LEN];
+    uint32_t chunk[CLI_CODE_CHUNK_LEN];
+    for (size_t i = 0; i < CLI_CODE_CHUNK_LEN; i++) {
+        memcpy(keys[i], seed, sizeof(seed));  // NOLINT (GCC doesn't support _s)
+    }
+    for (uint32_t start = 0; start < cfg.code_count; start += CLI_CODE_CHUNK_LEN) {
+        const size_t len = cfg.code_count - start < CLI_CODE_CHUNK_LEN ? cfg.code_count - start : CLI_CODE_CHUNK_LEN;
+        for (size_t i = 0; i < len; i++) {
+            counters[i] = start + i;
+        }
+        hotp_generate_batch(&keys[0][0], SEED_LEN, counters, len, digits, chunk);
+        for (size_t i = 0; i < len; i++) {
+            char code[HOTP_CODE_STR_LEN];
+            hotp_format(chunk[i], digits, code);
+            printf("%u: %s\n", (unsigned int)(start + i), code);
+        }
+    }
+    return 0;
 }
 
 int main(int argc, const char *argv[]) {
@@ -56,31 +367,55 @@ int main(int argc, const char *argv[]) {
         cli_print_help(argv[0]);
         exit(EXIT_SUCCESS);
     }
+    // Manifests and codes don't involve the device either
+    if (cfg.action == CLI_ACTION_MANIFEST) {
+        exit(manifest(cfg) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (cfg.action == CLI_ACTION_CODES) {
+        exit(codes(cfg) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    USBContext *ctx = NULL;
+    int err = hyperhotp_context_init(&ctx);
+    if (err != 0) {
+        char *msg = log_get_last_error_string();
+        log_fatal(msg);
+        log_free_error_string(msg);
+    }
+    if (cfg.action == CLI_ACTION_LIST) {
+        list(ctx);
+        hyperhotp_context_cleanup(ctx);
+        exit(EXIT_SUCCESS);
+    }
 
-    libusb_device_handle *handle = NULL;
+    deadline_init(&DEADLINE, DEADLINE_INFINITE);
+    signal(SIGINT, on_sigint);
+
+    if (cfg.action == CLI_ACTION_WATCH) {
+        watch(ctx);
+        hyperhotp_context_cleanup(ctx);
+        exit(EXIT_SUCCESS);
+    }
+
+    USBDevice *dev = NULL;
     FIDOCID cid;
-    int err = hyperhotp_init(&handle, cid);
+    err = hyperhotp_init(ctx, &dev, cid, &DEADLINE);
     if (err != 0) {
         char *msg = log_get_last_error_string();
         log_fatal(msg);
         log_free_error_string(msg);
     }
 
-    switch (cfg.action) {
-        case CLI_ACTION_CHECK:
-            check(handle, cid);
-            break;
-        case CLI_ACTION_RESET:
-            reset(handle, cid);
-            break;
-        case CLI_ACTION_PROGRAM:
-            program(handle, cid, cfg);
-            break;
-        default:
-            log_fatal("Unknown CLI action, this is a bug");
-            break;
+    HyperhotpSession session;
+    hyperhotp_session_init(&session, ctx);
+    hyperhotp_session_update(&session, dev, cid);
+    if (cfg.action == CLI_ACTION_SCRIPT) {
+        err = script(&session, dev, cfg);
+    } else {
+        err = run(&session, dev, cfg);
     }
 
-    hyperhotp_cleanup(handle);
-    return EXIT_SUCCESS;
+    hyperhotp_cleanup(dev);
+    hyperhotp_context_cleanup(ctx);
+    return err == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,75 @@
+#include "deadline.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t deadline_now_ms(void) {
+#ifdef _WIN32
+    return (uint64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+uint64_t deadline_now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    // Split up to not overflow
+    const uint64_t secs = (uint64_t)(count.QuadPart / freq.QuadPart);
+    const uint64_t rest = (uint64_t)(count.QuadPart % freq.QuadPart);
+    return secs * 1000000 + rest * 1000000 / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+void deadline_init(Deadline *deadline, const uint64_t timeout_ms) {
+    if (timeout_ms == DEADLINE_INFINITE) {
+        deadline->expires_at_ms = DEADLINE_INFINITE;
+    } else {
+        deadline->expires_at_ms = deadline_now_ms() + timeout_ms;
+    }
+    atomic_init(&deadline->cancelled, false);
+}
+
+void deadline_cancel(Deadline *deadline) { atomic_store(&deadline->cancelled, true); }
+
+bool deadline_is_cancelled(const Deadline *deadline) {
+    if (deadline == NULL) {
+        return false;
+    }
+    return atomic_load((atomic_bool *)&deadline->cancelled);
+}
+
+bool deadline_expired(const Deadline *deadline) { return deadline_remaining_ms(deadline) == 0; }
+
+uint64_t deadline_remaining_ms(const Deadline *deadline) {
+    if (deadline == NULL) {
+        return DEADLINE_INFINITE;
+    }
+    if (deadline_is_cancelled(deadline)) {
+        return 0;
+    }
+    if (deadline->expires_at_ms == DEADLINE_INFINITE) {
+        return DEADLINE_INFINITE;
+    }
+    const uint64_t now = deadline_now_ms();
+    if (now >= deadline->expires_at_ms) {
+        return 0;
+    }
+    return deadline->expires_at_ms - now;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Pass as timeout to never expire (the operation can still be cancelled)
+#define DEADLINE_INFINITE UINT64_MAX
+
+// Bounds how long an operation may take, and allows aborting it from another thread.
+// Operations take a pointer to one of these, NULL means "wait forever, not cancellable".
+typedef struct {
+    // Point on the monotonic clock (in ms) after which the operation is abandoned, or DEADLINE_INFINITE
+    uint64_t expires_at_ms;
+    atomic_bool cancelled;
+} Deadline;
+
+// Current time on the monotonic clock, in ms.
+uint64_t deadline_now_ms(void);
+
+// Same, in µs, for measuring rather than bounding how long something takes.
+uint64_t deadline_now_us(void);
+
+// Arm the deadline to expire timeout_ms from now.
+void deadline_init(Deadline *deadline, const uint64_t timeout_ms);
+
+// Abort any operation running under this deadline. Safe to call from other threads and signal handlers.
+void deadline_cancel(Deadline *deadline);
+
+bool deadline_is_cancelled(const Deadline *deadline);
+
+// Returns true if the deadline has passed or was cancelled.
+bool deadline_expired(const Deadline *deadline);
+
+// Returns the ms left until expiry, 0 if expired and DEADLINE_INFINITE if it never expires.
+uint64_t deadline_remaining_ms(const Deadline *deadline);
@@ -0,0 +1,130 @@
+#include "hotp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sha1.h"
+
+static const uint32_t HOTP_POWERS_OF_10[HOTP_MAX_DIGITS + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+};
+
+unsigned int hotp_digits(const bool is_8_char_code) { return is_8_char_code ? 8 : 6; }
+
+// Dynamic truncation: The last nibble picks which 4 bytes of the MAC to use, minus their sign bit.
+static uint32_t hotp_truncate(const uint8_t mac[SHA1_DIGEST_LEN], const unsigned int digits) {
+    const size_t offset = mac[SHA1_DIGEST_LEN - 1] & 0x0f;
+    const uint32_t bin = (uint32_t)(mac[offset] & 0x7f) << 24 | (uint32_t)mac[offset + 1] << 16 |
+                         (uint32_t)mac[offset + 2] << 8 | (uint32_t)mac[offset + 3];
+    return bin % HOTP_POWERS_OF_10[digits > HOTP_MAX_DIGITS ? HOTP_MAX_DIGITS : digits];
+}
+
+uint32_t hotp_generate(const uint8_t *key, const size_t key_len, const uint64_t counter, const unsigned int digits) {
+    // The counter is hashed as 8 bytes, most significant first
+    uint8_t msg[8];
+    for (size_t i = 0; i < sizeof(msg); i++) {
+        msg[i] = (uint8_t)(counter >> (8 * (sizeof(msg) - 1 - i)));
+    }
+    uint8_t mac[SHA1_DIGEST_LEN];
+    hmac_sha1(key, key_len, msg, sizeof(msg), mac);
+    return hotp_truncate(mac, digits);
+}
+
+// Start each lane's state off with the SHA-1 initial values.
+static void hotp_lanes_init(uint32_t state[5][SHA1_LANES]) {
+    static const uint32_t iv[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    for (size_t i = 0; i < 5; i++) {
+        for (size_t lane = 0; lane < SHA1_LANES; lane++) {
+            state[i][lane] = iv[i];
+        }
+    }
+}
+
+// Fill each lane's block with its key, zero padded to a whole block and xored with the HMAC pad.
+static void hotp_lanes_key_block(uint32_t block[16][SHA1_LANES], const uint8_t *keys, const size_t key_len,
+                                 const size_t lanes, const uint32_t pad) {
+    for (size_t lane = 0; lane < SHA1_LANES; lane++) {
+        uint8_t key[SHA1_BLOCK_LEN] = {0};
+        if (lane < lanes) {
+            memcpy(key, keys + lane * key_len, key_len);  // NOLINT (GCC doesn't support _s)
+        }
+        for (size_t i = 0; i < 16; i++) {
+            const uint8_t *p = key + 4 * i;
+            block[i][lane] = ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3]) ^ pad;
+        }
+    }
+}
+
+/*
+ * Compute up to SHA1_LANES codes. With keys no longer than a block and messages this short, HMAC-SHA1 is exactly
+ * 4 compressions: The inner key block, the counter, the outer key block and the inner digest.
+ */
+static void hotp_generate_lanes(const uint8_t *keys, const size_t key_len, const uint64_t *counters, const size_t lanes,
+                                const unsigned int digits, uint32_t *codes) {
+    uint32_t inner[5][SHA1_LANES];
+    uint32_t outer[5][SHA1_LANES];
+    uint32_t block[16][SHA1_LANES];
+
+    hotp_lanes_init(inner);
+    hotp_lanes_key_block(block, keys, key_len, lanes, 0x36363636);
+    sha1_compress_multi(inner, block);
+    // The counter as 8 bytes, then padding up to the bit length of key block and counter
+    memset(block, 0, sizeof(block));  // NOLINT (GCC doesn't support _s)
+    for (size_t lane = 0; lane < lanes; lane++) {
+        block[0][lane] = (uint32_t)(counters[lane] >> 32);
+        block[1][lane] = (uint32_t)counters[lane];
+    }
+    for (size_t lane = 0; lane < SHA1_LANES; lane++) {
+        block[2][lane] = 0x80000000;
+        block[15][lane] = (SHA1_BLOCK_LEN + 8) * 8;
+    }
+    sha1_compress_multi(inner, block);
+
+    hotp_lanes_init(outer);
+    hotp_lanes_key_block(block, keys, key_len, lanes, 0x5c5c5c5c);
+    sha1_compress_multi(outer, block);
+    // The inner digest, then padding up to the bit length of key block and digest
+    memset(block, 0, sizeof(block));  // NOLINT (GCC doesn't support _s)
+    for (size_t lane = 0; lane < SHA1_LANES; lane++) {
+        for (size_t i = 0; i < 5; i++) {
+            block[i][lane] = inner[i][lane];
+        }
+        block[5][lane] = 0x80000000;
+        block[15][lane] = (SHA1_BLOCK_LEN + SHA1_DIGEST_LEN) * 8;
+    }
+    sha1_compress_multi(outer, block);
+
+    for (size_t lane = 0; lane < lanes; lane++) {
+        uint8_t mac[SHA1_DIGEST_LEN];
+        for (size_t i = 0; i < 5; i++) {
+            mac[4 * i] = (uint8_t)(outer[i][lane] >> 24);
+            mac[4 * i + 1] = (uint8_t)(outer[i][lane] >> 16);
+            mac[4 * i + 2] = (uint8_t)(outer[i][lane] >> 8);
+            mac[4 * i + 3] = (uint8_t)outer[i][lane];
+        }
+        codes[lane] = hotp_truncate(mac, digits);
+    }
+}
+
+void hotp_generate_batch(const uint8_t *keys, const size_t key_len, const uint64_t *counters, const size_t count,
+                         const unsigned int digits, uint32_t *codes) {
+    // Longer keys would have to be hashed first, which isn't worth batching
+    if (key_len > SHA1_BLOCK_LEN) {
+        for (size_t i = 0; i < count; i++) {
+            codes[i] = hotp_generate(keys + i * key_len, key_len, counters[i], digits);
+        }
+        return;
+    }
+    for (size_t i = 0; i < count; i += SHA1_LANES) {
+        const size_t lanes = count - i < SHA1_LANES ? count - i : SHA1_LANES;
+        hotp_generate_lanes(keys + i * key_len, key_len, counters + i, lanes, digits, codes + i);
+    }
+}
+
+void hotp_format(const uint32_t code, const unsigned int digits, char str[HOTP_CODE_STR_LEN]) {
+    snprintf(str, HOTP_CODE_STR_LEN, "%0*u", (int)(digits > HOTP_MAX_DIGITS ? HOTP_MAX_DIGITS : digits),
+             (unsigned int)code);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Most digits a code can have, and room for one formatted as a string
+#define HOTP_MAX_DIGITS   8
+#define HOTP_CODE_STR_LEN (HOTP_MAX_DIGITS + 1)
+
+// Number of digits in the codes of a key programmed with the given is_8_char_code flag.
+unsigned int hotp_digits(const bool is_8_char_code);
+
+/*
+ * Compute the HOTP (RFC 4226) code for counter: HMAC-SHA1 of the counter under key, dynamically truncated to 31 bits
+ * and reduced to the given number of digits (1 to HOTP_MAX_DIGITS).
+ * The key is the seed in its binary form, i.e. SEED_LEN bytes for a seed as taken by hyperhotp_program().
+ */
+uint32_t hotp_generate(const uint8_t *key, const size_t key_len, const uint64_t counter, const unsigned int digits);
+
+/*
+ * Same as hotp_generate(), for count (key, counter) pairs at once, storing count codes. keys holds count keys of
+ * key_len bytes back to back. The pairs are hashed SHA1_LANES at a time using sha1_compress_multi(), unless the keys
+ * are longer than SHA1_BLOCK_LEN bytes.
+ */
+void hotp_generate_batch(const uint8_t *keys, const size_t key_len, const uint64_t *counters, const size_t count,
+                         const unsigned int digits, uint32_t *codes);
+
+// Format a code with leading zeroes, as shown by the key.
+void hotp_format(const uint32_t code, const unsigned int digits, char str[HOTP_CODE_STR_LEN]);
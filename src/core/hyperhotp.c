@@ -2,247 +2,860 @@
 
 #include <libusb.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "deadline.h"
 #include "log.h"
+#include "seed.h"
 #include "u2fhid.h"
 #include "usb.h"
 
-int hyperhotp_init(libusb_device_handle **handle, FIDOCID cid) {
-    int err = usb_init(handle);
+_Static_assert(HYPERHOTP_SEED_LEN_ASCII == SEED_LEN_ASCII && HYPERHOTP_SEED_LEN_HEX == SEED_LEN,
+               "Seeds are decoded by the seed module");
+
+int hyperhotp_context_init(USBContext **ctx) { return usb_context_init(ctx); }
+
+void hyperhotp_context_cleanup(USBContext *ctx) { usb_context_cleanup(ctx); }
+
+int hyperhotp_enumerate(USBContext *ctx, USBDeviceInfo **devices, size_t *count) {
+    return usb_enumerate(ctx, devices, count);
+}
+
+void hyperhotp_free_device_list(USBDeviceInfo *devices, const size_t count) { usb_free_device_list(devices, count); }
+
+int hyperhotp_alloc_channel(USBDevice *dev, FIDOCID cid, const Deadline *deadline) {
+    return fido_alloc_channel(dev, cid, deadline);
+}
+
+int hyperhotp_init(USBContext *ctx, USBDevice **dev, FIDOCID cid, const Deadline *deadline) {
+    int err = usb_init(ctx, dev);
     if (err != 0) {
         return -1;
     }
-    err = fido_alloc_channel(*handle, cid);
+    err = hyperhotp_alloc_channel(*dev, cid, deadline);
     if (err != 0) {
+        usb_cleanup(*dev);
         return -1;
     }
     return 0;
 }
 
-// This seems to be a magic sequence the Windows client executes before every transaction.
-static int hyperhotp_magic(libusb_device_handle *handle, const FIDOCID cid) {
-    // Ping
-    log_debug("Sending ping");
-    // No idea why this is so large or what the data means
-    const uint8_t data[14] = {0x00, 0xa4, 0x04, 0x00, 0x09, 0xd1, 0x56, 0x00, 0x01, 0x32, 0x83, 0x26, 0x01, 0x01};
-    const FIDOInitPacket ping = fido_craft_packet(cid, U2FHID_ADPU_RAW, 14, data);
-    int err = fido_send_packet(handle, ping);
+int hyperhotp_init_device(USBContext *ctx, const USBDeviceInfo *info, USBDevice **dev, FIDOCID cid,
+                          const Deadline *deadline) {
+    int err = usb_open(ctx, info, dev);
     if (err != 0) {
         return -1;
     }
-
-    // Pong
-    log_debug("Waiting for pong");
-    FIDOInitPacket pong;
-    err = fido_recv_packet(handle, &pong);
+    err = hyperhotp_alloc_channel(*dev, cid, deadline);
     if (err != 0) {
+        usb_cleanup(*dev);
         return -1;
     }
-    if (fido_is_error_packet(pong)) {
-        log_error("Failed to send ping: Got error response back");
+    return 0;
+}
+
+void hyperhotp_session_init(HyperhotpSession *session, USBContext *ctx) {
+    memset(session, 0, sizeof(HyperhotpSession));  // NOLINT (GCC doesn't support _s)
+    session->ctx = ctx;
+}
+
+static HyperhotpKnownKey *hyperhotp_session_find(HyperhotpSession *session, const USBDeviceInfo *info) {
+    for (size_t i = 0; i < session->num_keys; i++) {
+        HyperhotpKnownKey *key = &session->keys[i];
+        if (key->bus == info->bus && key->port_path_len == info->port_path_len &&
+            memcmp(key->port_path, info->port_path, info->port_path_len) == 0 && key->vendor_id == info->vendor_id &&
+            key->product_id == info->product_id) {
+            return key;
+        }
+    }
+    return NULL;
+}
+
+// Forget what the session knows about the key's state, which makes the next operation ask again.
+static void hyperhotp_session_invalidate(HyperhotpKnownKey *key) {
+    key->selected = false;
+    key->programmed = -1;
+}
+
+void hyperhotp_session_update(HyperhotpSession *session, const USBDevice *dev, const FIDOCID cid) {
+    HyperhotpKnownKey *key = hyperhotp_session_find(session, &dev->info);
+    if (key == NULL) {
+        if (session->num_keys < HYPERHOTP_SESSION_MAX_KEYS) {
+            key = &session->keys[session->num_keys++];
+        } else {
+            key = &session->keys[session->next_evict];
+            session->next_evict = (session->next_evict + 1) % HYPERHOTP_SESSION_MAX_KEYS;
+        }
+        key->bus = dev->info.bus;
+        memcpy(key->port_path, dev->info.port_path, USB_MAX_PORT_DEPTH);  // NOLINT (GCC doesn't support _s)
+        key->port_path_len = dev->info.port_path_len;
+        key->vendor_id = dev->info.vendor_id;
+        key->product_id = dev->info.product_id;
+        memcpy(key->cid, cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+        hyperhotp_session_invalidate(key);
+    } else if (memcmp(key->cid, cid, FIDO_CID_LEN) != 0) {
+        // A new channel means the key has been reset, or at least someone else talked to it
+        memcpy(key->cid, cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+        hyperhotp_session_invalidate(key);
+    }
+}
+
+void hyperhotp_session_forget(HyperhotpSession *session, const USBDevice *dev) {
+    HyperhotpKnownKey *key = hyperhotp_session_find(session, &dev->info);
+    if (key == NULL) {
+        return;
+    }
+    // Order doesn't matter, so fill the gap with the last entry
+    *key = session->keys[--session->num_keys];
+    if (session->next_evict >= session->num_keys) {
+        session->next_evict = 0;
+    }
+}
+
+int hyperhotp_session_channel(HyperhotpSession *session, USBDevice *dev, FIDOCID cid, const Deadline *deadline) {
+    const HyperhotpKnownKey *key = hyperhotp_session_find(session, &dev->info);
+    if (key != NULL) {
+        log_debug("Reusing channel of known key");
+        memcpy(cid, key->cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+        return 0;
+    }
+    if (hyperhotp_alloc_channel(dev, cid, deadline) != 0) {
         return -1;
     }
-    log_debug("Pong");
+    hyperhotp_session_update(session, dev, cid);
     return 0;
 }
 
-int hyperhotp_check_programmed(libusb_device_handle *handle, const FIDOCID cid, char serial[HYPERHOTP_SERIAL_LEN]) {
-    int err = hyperhotp_magic(handle, cid);
+int hyperhotp_session_open(HyperhotpSession *session, const USBDeviceInfo *info, USBDevice **dev, FIDOCID cid,
+                           const Deadline *deadline) {
+    int err = usb_open(session->ctx, info, dev);
     if (err != 0) {
         return -1;
     }
-
-    // Send a packet to get programmed serial
-    const uint8_t data[4] = {0x00, 0xe6, 0x00, 0x00};
-    const FIDOInitPacket req = fido_craft_packet(cid, U2FHID_ADPU_RAW, 4, data);
-    err = fido_send_packet(handle, req);
+    err = hyperhotp_session_channel(session, *dev, cid, deadline);
     if (err != 0) {
+        usb_cleanup(*dev);
         return -1;
     }
+    return 0;
+}
+
+const char *hyperhotp_step_name(const HyperhotpStep step) {
+    switch (step) {
+        case HYPERHOTP_STEP_PING:
+            return "ping";
+        case HYPERHOTP_STEP_STATUS:
+            return "status";
+        case HYPERHOTP_STEP_RESET:
+            return "reset";
+        case HYPERHOTP_STEP_COMMAND:
+            return "command";
+        case HYPERHOTP_STEP_VERIFY_PING:
+            return "verify ping";
+        case HYPERHOTP_STEP_VERIFY_STATUS:
+            return "verify status";
+        default:
+            return "unknown";
+    }
+}
 
-    // Parse response
-    FIDOInitPacket resp;
-    err = fido_recv_packet(handle, &resp);
-    if (err != 0) {
-        return -1;
+// Book the exchange that just completed onto the step it was sent for.
+static void hyperhotp_op_account(HyperhotpOp *op, const FIDOExchange *exchange) {
+    HyperhotpStats *stats = &op->stats.steps[op->step];
+    const uint64_t elapsed_us = deadline_now_us() - op->step_started_at_us;
+    stats->exchanges++;
+    stats->transfers += exchange->transfers;
+    stats->bytes_sent += exchange->bytes_sent;
+    stats->bytes_received += exchange->bytes_received;
+    stats->device_us += exchange->device_wait_us;
+    stats->host_us += elapsed_us > exchange->device_wait_us ? elapsed_us - exchange->device_wait_us : 0;
+}
+
+// Sum up the steps. Time between them counts as host time.
+static void hyperhotp_op_account_total(HyperhotpOp *op) {
+    HyperhotpStats *total = &op->stats.total;
+    memset(total, 0, sizeof(HyperhotpStats));  // NOLINT (GCC doesn't support _s)
+    for (size_t i = 0; i < HYPERHOTP_STEP_COUNT; i++) {
+        const HyperhotpStats *step = &op->stats.steps[i];
+        total->exchanges += step->exchanges;
+        total->transfers += step->transfers;
+        total->bytes_sent += step->bytes_sent;
+        total->bytes_received += step->bytes_received;
+        total->device_us += step->device_us;
+    }
+    const uint64_t elapsed_us = deadline_now_us() - op->started_at_us;
+    total->host_us = elapsed_us > total->device_us ? elapsed_us - total->device_us : 0;
+}
+
+static void hyperhotp_op_finish(HyperhotpOp *op, const int result) {
+    hyperhotp_op_account_total(op);
+    op->done = true;
+    op->result = result;
+    if (op->callback != NULL) {
+        op->callback(op);
     }
-    if (fido_is_error_packet(resp)) {
+}
+
+// No idea why this is so large or what the data means
+static const uint8_t HYPERHOTP_PING_REQUEST[14] = {0x00, 0xa4, 0x04, 0x00, 0x09, 0xd1, 0x56,
+                                                   0x00, 0x01, 0x32, 0x83, 0x26, 0x01, 0x01};
+
+// Get programmed serial
+static const uint8_t HYPERHOTP_STATUS_REQUEST[4] = {0x00, 0xe6, 0x00, 0x00};
+
+static const uint8_t HYPERHOTP_RESET_REQUEST[4] = {0x00, 0x07, 0x00, 0x00};
+
+static void hyperhotp_build_program_request(uint8_t data[HYPERHOTP_PROGRAM_REQUEST_LEN], const bool is_8_char_code,
+                                            const char serial[HYPERHOTP_SERIAL_LEN],
+                                            const uint8_t seed[HYPERHOTP_SEED_LEN_HEX]) {
+    static const uint8_t TEMPLATE[HYPERHOTP_PROGRAM_REQUEST_LEN] = {
+        0x00, 0x09, 0x00, 0x00, 0x23, 0x53, 0x16, 0x01, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x51, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };  // All non-0 fields are magic
+    memcpy(data, TEMPLATE, HYPERHOTP_PROGRAM_REQUEST_LEN);  // NOLINT (GCC doesn't support _s)
+    if (is_8_char_code) {
+        data[9] = 0x08;
+    } else {
+        data[9] = 0x06;
+    }
+    memcpy(data + 10, seed, HYPERHOTP_SEED_LEN_HEX);  // NOLINT (GCC doesn't support _s)
+    memcpy(data + 32, serial, HYPERHOTP_SERIAL_LEN);  // NOLINT (GCC doesn't support _s)
+}
+
+// Returns 1 if programmed (and fills in the serial), 0 if not programmed, -1 on failure (and fills in the error).
+static int hyperhotp_parse_status(const FIDOReassembly *resp, char serial[HYPERHOTP_SERIAL_LEN], FIDOError *error) {
+    if (fido_message_is_error(resp)) {
         log_error("Failed to check whether key is programmed: Got error response back");
+        *error = fido_message_error(resp);
         return -1;
     }
-    // Seems like this byte is always set when a key is programmed
-    bool key_programmed = false;
-    switch (resp.data[11]) {
+    // Seems like this byte is always set when a key is programmed. It's 0 if the response is too short to include it.
+    const uint8_t programmed = resp->len > 11 ? resp->buf[11] : 0x00;
+    switch (programmed) {
         case 0x00:
-            key_programmed = false;
-            break;
+            return 0;
         case 0x90:
-            key_programmed = true;
-            break;
+            memcpy(serial, resp->buf + 3, HYPERHOTP_SERIAL_LEN * sizeof(uint8_t));  // NOLINT (GCC doesn't support _s)
+            return 1;
         default:
             log_error("Failed to check whether key is programmed: Encountered unexpected value in response");
+            *error = FIDO_ERROR_PROTOCOL;
             return -1;
+    }
+}
+
+// Decode the status word the reset or program command was answered with.
+static FIDOError hyperhotp_transaction_error(const FIDOReassembly *resp) {
+    if (fido_message_is_error(resp)) {
+        return fido_message_error(resp);
+    }
+    if (resp->len < 1) {
+        log_error("Unknown bytes in response from device when reading whether reset succeeded");
+        return FIDO_ERROR_PROTOCOL;
+    }
+    const uint16_t status_word = (uint16_t)(resp->buf[0] << 8 | (resp->len > 1 ? resp->buf[1] : 0x00));
+    const FIDOError error = fido_status_word_error(status_word);
+    if (error == FIDO_ERROR_APDU_OTHER) {
+        log_error("Unknown bytes in response from device when reading whether reset succeeded");
+    }
+    return error;
+}
+
+static void hyperhotp_op_exchanged(FIDOExchange *exchange, const int result);
+
+static void hyperhotp_op_progress(FIDOExchange *exchange, const FIDORoute event, const uint8_t status) {
+    HyperhotpOp *op = (HyperhotpOp *)exchange->user_data;
+    if (event == FIDO_ROUTE_KEEPALIVE && status == U2FHID_KEEPALIVE_UP_NEEDED && !op->waiting_for_button) {
+        log_debug("Waiting for the button to be pushed");
+        op->waiting_for_button = true;
+    }
+}
+
+static int hyperhotp_op_send_step(HyperhotpOp *op) {
+    uint8_t cmd = U2FHID_ADPU_RAW;
+    const uint8_t *req = NULL;
+    uint16_t req_len = 0;
+    switch (op->step) {
+        case HYPERHOTP_STEP_PING:
+        case HYPERHOTP_STEP_VERIFY_PING:
+            log_debug("Sending ping");
+            req = HYPERHOTP_PING_REQUEST;
+            req_len = sizeof(HYPERHOTP_PING_REQUEST);
+            break;
+        case HYPERHOTP_STEP_STATUS:
+        case HYPERHOTP_STEP_VERIFY_STATUS:
+            req = HYPERHOTP_STATUS_REQUEST;
+            req_len = sizeof(HYPERHOTP_STATUS_REQUEST);
+            break;
+        case HYPERHOTP_STEP_RESET:
+            req = HYPERHOTP_RESET_REQUEST;
+            req_len = sizeof(HYPERHOTP_RESET_REQUEST);
+            break;
+        case HYPERHOTP_STEP_COMMAND:
+        default:
+            if (op->type == HYPERHOTP_OP_RESET) {
+                req = HYPERHOTP_RESET_REQUEST;
+                req_len = sizeof(HYPERHOTP_RESET_REQUEST);
+            } else if (op->type == HYPERHOTP_OP_WINK) {
+                cmd = U2FHID_WINK;
+            } else if (op->type == HYPERHOTP_OP_LOCK) {
+                cmd = U2FHID_LOCK;
+                req = &op->lock_seconds;
+                req_len = 1;
+            } else {
+                req = op->program_request;
+                req_len = HYPERHOTP_PROGRAM_REQUEST_LEN;
+            }
             break;
     }
-    if (key_programmed) {
-        memcpy(serial, resp.data + 3, HYPERHOTP_SERIAL_LEN * sizeof(uint8_t));  // NOLINT (GCC doesn't support _s)
-        return 1;
+    op->step_started_at_us = deadline_now_us();
+    int err = fido_exchange_start(&op->exchange, op->dev, op->cid, cmd, req, req_len, op->response,
+                                  sizeof(op->response), op->deadline, hyperhotp_op_exchanged, op);
+    if (err != 0) {
+        op->error = op->exchange.error;
+        return -1;
     }
+    op->exchange.progress = hyperhotp_op_progress;
     return 0;
 }
 
-static bool hyperhotp_transaction_succeeded(const FIDOInitPacket resp) {
-    if (resp.data[0] == 0x69) {
-        return false;
-    } else if (resp.data[0] == 0x90) {
-        return true;
-    } else {
-        log_error("Unknown bytes in response from device when reading whether reset succeeded");
+// Handle the status query before the command. Returns 1 to continue with the command, otherwise the op's result.
+static int hyperhotp_op_check_precondition(HyperhotpOp *op, const int programmed) {
+    switch (op->type) {
+        case HYPERHOTP_OP_RESET:
+            if (programmed == 0) {
+                log_error("Device is not programmed, nothing to reset");
+                op->error = FIDO_ERROR_UNEXPECTED_STATE;
+                return -1;
+            } else if (programmed == 1) {
+                log_debug("Device is programmed, proceeding with reset");
+                return 1;
+            }
+            return -1;
+        case HYPERHOTP_OP_PROGRAM:
+            if (programmed == 1) {
+                log_error("Failed to program device: Device is already programmed. Please reset and try again.");
+                op->error = FIDO_ERROR_UNEXPECTED_STATE;
+                return -1;
+            } else if (programmed == -1) {
+                log_error("Failed to program device: Could not check whether device is already programmed.");
+                return -1;
+            }
+            return 1;
+        case HYPERHOTP_OP_REPROGRAM:
+            if (programmed == -1) {
+                log_error("Failed to reprogram device: Could not check whether device is programmed.");
+                return -1;
+            }
+            return 1;
+        case HYPERHOTP_OP_CHECK:
+        default:
+            return programmed;
     }
-    return false;
 }
 
-int hyperhotp_reset(libusb_device_handle *handle, const FIDOCID cid) {
-    char serial[HYPERHOTP_SERIAL_LEN];
+// The step following the status query: Reprogramming a key that isn't programmed needs no reset.
+static HyperhotpStep hyperhotp_op_command_step(const HyperhotpOp *op, const int programmed) {
+    return op->type == HYPERHOTP_OP_REPROGRAM && programmed == 1 ? HYPERHOTP_STEP_RESET : HYPERHOTP_STEP_COMMAND;
+}
+
+// Handle the status query after the command. Returns the op's result.
+static int hyperhotp_op_check_postcondition(HyperhotpOp *op, const int programmed) {
+    if (op->type == HYPERHOTP_OP_RESET) {
+        if (programmed == 1) {
+            log_error("Failed to reset device: Device reported successful reset, but device is not actually reset");
+            op->error = FIDO_ERROR_UNEXPECTED_STATE;
+            return -1;
+        }
+        return programmed == 0 ? 0 : -1;
+    }
 
-    int programmed = hyperhotp_check_programmed(handle, cid, serial);
     if (programmed == 0) {
-        log_error("Device is not programmed, nothing to reset");
+        log_error(
+            "Failed to program device: Device reported successful programming, but device is not actually programmed");
+        op->error = FIDO_ERROR_UNEXPECTED_STATE;
         return -1;
-    } else if (programmed == 1) {
-        log_debug("Device is programmed, proceeding with reset");
-    } else {
+    } else if (programmed == -1) {
+        return -1;
+    } else if (strncmp(op->serial, op->programmed_serial, HYPERHOTP_SERIAL_LEN) != 0) {
+        log_error(
+            "Failed to program device: Device reported successful programming, but serial number doesn't match the one "
+            "programmed. This is a bug in the programmer.");
+        op->error = FIDO_ERROR_UNEXPECTED_STATE;
         return -1;
     }
+    return 0;
+}
 
-    // Send reset request
-    const uint8_t data[4] = {0x00, 0x07, 0x00, 0x00};
-    const FIDOInitPacket req = fido_craft_packet(cid, U2FHID_ADPU_RAW, 4, data);
-    int err = fido_send_packet(handle, req);
-    if (err != 0) {
+// Handle the response to a wink or lock, which are plain U2FHID commands rather than APDUs. Returns the op's result.
+static int hyperhotp_op_check_control(HyperhotpOp *op, const FIDOReassembly *resp) {
+    const uint8_t expected = op->type == HYPERHOTP_OP_WINK ? U2FHID_WINK : U2FHID_LOCK;
+    if (fido_message_is_error(resp) || resp->cmd != expected) {
+        if (op->type == HYPERHOTP_OP_WINK) {
+            log_error("Failed to wink device: Device reported failure (perhaps it doesn't support winking?)");
+        } else {
+            log_error("Failed to lock device: Device reported failure");
+        }
+        op->error = fido_message_is_error(resp) ? fido_message_error(resp) : FIDO_ERROR_PROTOCOL;
         return -1;
     }
+    return 0;
+}
 
-    // Check response for success
-    FIDOInitPacket resp;
-    err = fido_recv_packet(handle, &resp);
-    if (err != 0) {
-        return -1;
+// Let the session know what the status query said.
+static void hyperhotp_op_remember_status(HyperhotpOp *op, const int programmed) {
+    if (op->key == NULL) {
+        return;
     }
-    if (!hyperhotp_transaction_succeeded(resp) || fido_is_error_packet(resp)) {
-        log_error("Failed to reset device: Device reported failure (perhaps you didn't push the button?)");
-    } else {
-        programmed = hyperhotp_check_programmed(handle, cid, serial);
-        if (programmed == 1) {
-            log_error("Failed to reset device: Device reported successful reset, but device is not actually reset");
-        } else if (programmed == 0) {
+    op->key->programmed = programmed;
+    memcpy(op->key->serial, op->programmed_serial, HYPERHOTP_SERIAL_LEN);  // NOLINT (GCC doesn't support _s)
+}
+
+// Let the session know the applet has been wiped or rewritten, which leaves it unselected.
+static void hyperhotp_op_deselect(HyperhotpOp *op) {
+    if (op->key != NULL) {
+        op->key->selected = false;
+    }
+}
+
+// Send the request of the current step, skipping those whose answer the session already knows.
+// The op may be finished straight away if the known state of the key rules it out.
+static int hyperhotp_op_run_step(HyperhotpOp *op) {
+    const HyperhotpKnownKey *key = op->key;
+    if (key == NULL) {
+        return hyperhotp_op_send_step(op);
+    }
+    if (key->selected && (op->step == HYPERHOTP_STEP_PING || op->step == HYPERHOTP_STEP_VERIFY_PING)) {
+        log_debug("Applet is still selected, skipping ping");
+        op->step++;
+    }
+    if (op->step == HYPERHOTP_STEP_STATUS && op->type != HYPERHOTP_OP_CHECK && key->programmed != -1) {
+        log_debug("State of the key is known, skipping status query");
+        memcpy(op->programmed_serial, key->serial, HYPERHOTP_SERIAL_LEN);  // NOLINT (GCC doesn't support _s)
+        const int outcome = hyperhotp_op_check_precondition(op, key->programmed);
+        if (outcome != 1) {
+            hyperhotp_op_finish(op, outcome);
             return 0;
         }
+        op->step = hyperhotp_op_command_step(op, key->programmed);
     }
-    return -1;
+    return hyperhotp_op_send_step(op);
 }
 
-static bool ascii_is_hex(const char x) {
-    return ((x >= '0' && x <= '9') || (x >= 'a' && x <= 'f') || (x >= 'A' && x <= 'F'));
-}
+static void hyperhotp_op_exchanged(FIDOExchange *exchange, const int result) {
+    HyperhotpOp *op = (HyperhotpOp *)exchange->user_data;
+    op->waiting_for_button = false;
+    hyperhotp_op_account(op, exchange);
+    if (result != 0) {
+        if (op->key != NULL) {
+            hyperhotp_session_invalidate(op->key);
+        }
+        op->error = exchange->error;
+        hyperhotp_op_finish(op, -1);
+        return;
+    }
+    // Follow the exchange onto a new channel, in case it had to re-sync. The key has been reset in that case.
+    if (op->key != NULL && memcmp(op->cid, exchange->cid, FIDO_CID_LEN) != 0) {
+        hyperhotp_session_invalidate(op->key);
+    }
+    memcpy(op->cid, exchange->cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+    const FIDOReassembly *resp = &exchange->response;
 
-static uint8_t ascii_2_hex(const char a_char, const char b_char) {
-    const uint8_t a = (uint8_t)a_char;
-    const uint8_t b = (uint8_t)b_char;
+    int programmed = 0;
+    int outcome = 0;
+    switch (op->step) {
+        case HYPERHOTP_STEP_PING:
+        case HYPERHOTP_STEP_VERIFY_PING:
+            if (fido_message_is_error(resp)) {
+                log_error("Failed to send ping: Got error response back");
+                op->error = fido_message_error(resp);
+                hyperhotp_op_finish(op, -1);
+                return;
+            }
+            log_debug("Pong");
+            if (op->key != NULL) {
+                op->key->selected = true;
+            }
+            op->step++;
+            break;
+        case HYPERHOTP_STEP_STATUS:
+            programmed = hyperhotp_parse_status(resp, op->programmed_serial, &op->error);
+            hyperhotp_op_remember_status(op, programmed);
+            outcome = hyperhotp_op_check_precondition(op, programmed);
+            if (op->type == HYPERHOTP_OP_CHECK || outcome != 1) {
+                hyperhotp_op_finish(op, outcome);
+                return;
+            }
+            op->step = hyperhotp_op_command_step(op, programmed);
+            break;
+        case HYPERHOTP_STEP_RESET:
+            op->error = hyperhotp_transaction_error(resp);
+            if (op->error != FIDO_ERROR_NONE) {
+                log_error("Failed to reprogram device: Device reported failure to reset (perhaps you didn't push the "
+                          "button?)");
+                hyperhotp_op_finish(op, -1);
+                return;
+            }
+            // Program straight away, the status query at the end verifies both. The applet is selected again only
+            // for that, but the session mustn't count on it still being selected if programming fails.
+            hyperhotp_op_remember_status(op, -1);
+            hyperhotp_op_deselect(op);
+            op->step = HYPERHOTP_STEP_COMMAND;
+            break;
+        case HYPERHOTP_STEP_COMMAND:
+            if (op->type == HYPERHOTP_OP_WINK || op->type == HYPERHOTP_OP_LOCK) {
+                hyperhotp_op_finish(op, hyperhotp_op_check_control(op, resp));
+                return;
+            }
+            op->error = hyperhotp_transaction_error(resp);
+            if (op->error != FIDO_ERROR_NONE) {
+                if (op->type == HYPERHOTP_OP_RESET) {
+                    log_error("Failed to reset device: Device reported failure (perhaps you didn't push the button?)");
+                } else {
+                    log_error(
+                        "Failed to program device: Device reported failure (perhaps you didn't push the button?)");
+                }
+                hyperhotp_op_finish(op, -1);
+                return;
+            }
+            // Unknown until verified, and the applet has to be selected again before the status query
+            hyperhotp_op_remember_status(op, -1);
+            hyperhotp_op_deselect(op);
+            op->step = HYPERHOTP_STEP_VERIFY_PING;
+            break;
+        case HYPERHOTP_STEP_VERIFY_STATUS:
+        default:
+            memset(op->programmed_serial, 0, HYPERHOTP_SERIAL_LEN);  // NOLINT (GCC doesn't support _s)
+            programmed = hyperhotp_parse_status(resp, op->programmed_serial, &op->error);
+            hyperhotp_op_remember_status(op, programmed);
+            hyperhotp_op_finish(op, hyperhotp_op_check_postcondition(op, programmed));
+            return;
+    }
+    if (hyperhotp_op_run_step(op) != 0) {
+        hyperhotp_op_finish(op, -1);
+    }
+}
 
-    uint8_t h = 0;
-    if (a >= '0' && a <= '9') {
-        h = ((a - '0') << 4);
-    } else if (a >= 'a' && a <= 'f') {
-        h = ((a - 'a' + 10) << 4);
-    } else if (a >= 'A' && a <= 'F') {
-        h = ((a - 'A' + 10) << 4);
+static void hyperhotp_op_init(HyperhotpOp *op, const HyperhotpOpType type, USBDevice *dev, const FIDOCID cid,
+                              const Deadline *deadline, HyperhotpOpCallback callback, void *user_data) {
+    memset(op, 0, sizeof(HyperhotpOp));  // NOLINT (GCC doesn't support _s)
+    op->type = type;
+    op->dev = dev;
+    memcpy(op->cid, cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+    op->deadline = deadline;
+    op->callback = callback;
+    op->user_data = user_data;
+    op->started_at_us = deadline_now_us();
+    // Neither wink nor lock needs the ping or status query, they go out straight away
+    if (type == HYPERHOTP_OP_WINK || type == HYPERHOTP_OP_LOCK) {
+        op->step = HYPERHOTP_STEP_COMMAND;
     } else {
-        log_fatal("Failed to convert char to hex: Out of range");
+        op->step = HYPERHOTP_STEP_PING;
     }
+}
 
-    if (b >= '0' && b <= '9') {
-        h = h | (b - '0');
-    } else if (b >= 'a' && b <= 'f') {
-        h = h | (b - 'a' + 10);
-    } else if (b >= 'A' && b <= 'F') {
-        h = h | (b - 'A' + 10);
-    } else {
-        log_fatal("Failed to convert char to hex: Out of range");
+int hyperhotp_check_programmed_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const Deadline *deadline,
+                                     HyperhotpOpCallback callback, void *user_data) {
+    hyperhotp_op_init(op, HYPERHOTP_OP_CHECK, dev, cid, deadline, callback, user_data);
+    return hyperhotp_op_run_step(op);
+}
+
+int hyperhotp_reset_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const Deadline *deadline,
+                          HyperhotpOpCallback callback, void *user_data) {
+    hyperhotp_op_init(op, HYPERHOTP_OP_RESET, dev, cid, deadline, callback, user_data);
+    return hyperhotp_op_run_step(op);
+}
+
+int hyperhotp_wink_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const Deadline *deadline,
+                         HyperhotpOpCallback callback, void *user_data) {
+    hyperhotp_op_init(op, HYPERHOTP_OP_WINK, dev, cid, deadline, callback, user_data);
+    return hyperhotp_op_run_step(op);
+}
+
+// Returns 0 on success, -1 if the parameters are invalid.
+static int hyperhotp_op_init_lock(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const uint8_t seconds,
+                                  const Deadline *deadline, HyperhotpOpCallback callback, void *user_data) {
+    if (seconds > U2FHID_MAX_LOCK_SECONDS) {
+        log_error("Failed to lock device: Locks can be held for at most 10 seconds");
+        op->error = FIDO_ERROR_INVALID_ARGUMENT;
+        return -1;
+    }
+    hyperhotp_op_init(op, HYPERHOTP_OP_LOCK, dev, cid, deadline, callback, user_data);
+    op->lock_seconds = seconds;
+    return 0;
+}
+
+int hyperhotp_lock_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const uint8_t seconds,
+                         const Deadline *deadline, HyperhotpOpCallback callback, void *user_data) {
+    if (hyperhotp_op_init_lock(op, dev, cid, seconds, deadline, callback, user_data) != 0) {
+        return -1;
+    }
+    return hyperhotp_op_run_step(op);
+}
+
+// Prepare a program or reprogram op. Returns 0 on success, -1 if the parameters are invalid.
+static int hyperhotp_op_init_program(HyperhotpOp *op, const HyperhotpOpType type, USBDevice *dev, const FIDOCID cid,
+                                     const bool is_8_char_code, const char serial[HYPERHOTP_SERIAL_LEN],
+                                     const char seed[HYPERHOTP_SEED_LEN_ASCII], const Deadline *deadline,
+                                     HyperhotpOpCallback callback, void *user_data) {
+    uint8_t hex_seed[HYPERHOTP_SEED_LEN_HEX] = {0};
+    if (seed_decode(seed, hex_seed) != 0) {
+        log_error("Failed to program device: Seed contains non-hex characters");
+        op->error = FIDO_ERROR_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    hyperhotp_op_init(op, type, dev, cid, deadline, callback, user_data);
+    memcpy(op->serial, serial, HYPERHOTP_SERIAL_LEN);  // NOLINT (GCC doesn't support _s)
+    hyperhotp_build_program_request(op->program_request, is_8_char_code, serial, hex_seed);
+    return 0;
+}
+
+int hyperhotp_program_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const bool is_8_char_code,
+                            const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                            const Deadline *deadline, HyperhotpOpCallback callback, void *user_data) {
+    if (hyperhotp_op_init_program(op, HYPERHOTP_OP_PROGRAM, dev, cid, is_8_char_code, serial, seed, deadline, callback,
+                                  user_data) != 0) {
+        return -1;
+    }
+    return hyperhotp_op_run_step(op);
+}
+
+int hyperhotp_reprogram_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const bool is_8_char_code,
+                              const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                              const Deadline *deadline, HyperhotpOpCallback callback, void *user_data) {
+    if (hyperhotp_op_init_program(op, HYPERHOTP_OP_REPROGRAM, dev, cid, is_8_char_code, serial, seed, deadline,
+                                  callback, user_data) != 0) {
+        return -1;
+    }
+    return hyperhotp_op_run_step(op);
+}
+
+void hyperhotp_op_cancel(HyperhotpOp *op) {
+    if (!op->done) {
+        fido_exchange_cancel(&op->exchange);
+    }
+}
+
+// Kept per thread like the log module's last error, so threads driving different devices can't overwrite each other's
+static _Thread_local FIDOError HYPERHOTP_LAST_ERROR = FIDO_ERROR_NONE;
+
+static _Thread_local HyperhotpOpStats HYPERHOTP_LAST_STATS;
+
+FIDOError hyperhotp_get_last_error(void) { return HYPERHOTP_LAST_ERROR; }
+
+void hyperhotp_get_last_stats(HyperhotpOpStats *stats) { *stats = HYPERHOTP_LAST_STATS; }
+
+// Record why starting the operation of a synchronous function failed, if it did. Returns err.
+static int hyperhotp_op_started(HyperhotpOp *op, const int err) {
+    HYPERHOTP_LAST_ERROR = err != 0 ? op->error : FIDO_ERROR_NONE;
+    if (err != 0) {
+        memset(&HYPERHOTP_LAST_STATS, 0, sizeof(HyperhotpOpStats));  // NOLINT (GCC doesn't support _s)
     }
-    return h;
+    return err;
 }
 
-int hyperhotp_program(libusb_device_handle *handle, const FIDOCID cid, const bool is_8_char_code,
-                      const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII]) {
-    char curr_serial[HYPERHOTP_SERIAL_LEN];
-    int programmed = hyperhotp_check_programmed(handle, cid, curr_serial);
+// Drive the operation to completion, then hand back the channel it ended up on.
+static int hyperhotp_op_wait(HyperhotpOp *op, FIDOCID cid) {
+    bool cancelling = false;
+    while (!op->done) {
+        if (!cancelling && deadline_expired(op->deadline)) {
+            hyperhotp_op_cancel(op);
+            cancelling = true;
+        }
+        uint64_t slice_ms = deadline_remaining_ms(op->deadline);
+        if (slice_ms > USB_ASYNC_POLL_INTERVAL_MS || cancelling) {
+            slice_ms = USB_ASYNC_POLL_INTERVAL_MS;
+        }
+        int err = usb_context_handle_events(op->dev->ctx, (int)slice_ms);
+        if (err != 0 && !cancelling) {
+            // Same as libusb's own synchronous API: Give up, but keep handling events until the transfer is reaped
+            hyperhotp_op_cancel(op);
+            cancelling = true;
+        }
+    }
+    memcpy(cid, op->cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+    HYPERHOTP_LAST_ERROR = op->result == -1 ? op->error : FIDO_ERROR_NONE;
+    HYPERHOTP_LAST_STATS = op->stats;
+    return op->result;
+}
+
+int hyperhotp_process_events(USBContext *ctx) { return usb_context_handle_events(ctx, 0); }
+
+int hyperhotp_check_programmed(USBDevice *dev, FIDOCID cid, char serial[HYPERHOTP_SERIAL_LEN],
+                               const Deadline *deadline) {
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(&op, hyperhotp_check_programmed_async(&op, dev, cid, deadline, NULL, NULL));
+    if (err != 0) {
+        return -1;
+    }
+    const int programmed = hyperhotp_op_wait(&op, cid);
     if (programmed == 1) {
-        log_error("Failed to program device: Device is already programmed. Please reset and try again.");
+        memcpy(serial, op.programmed_serial, HYPERHOTP_SERIAL_LEN);  // NOLINT (GCC doesn't support _s)
+    }
+    return programmed;
+}
+
+int hyperhotp_reset(USBDevice *dev, FIDOCID cid, const Deadline *deadline) {
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(&op, hyperhotp_reset_async(&op, dev, cid, deadline, NULL, NULL));
+    if (err != 0) {
         return -1;
-    } else if (programmed == -1) {
-        log_error("Failed to program device: Could not check whether device is already programmed.");
+    }
+    return hyperhotp_op_wait(&op, cid);
+}
+
+int hyperhotp_program(USBDevice *dev, FIDOCID cid, const bool is_8_char_code, const char serial[HYPERHOTP_SERIAL_LEN],
+                      const char seed[HYPERHOTP_SEED_LEN_ASCII], const Deadline *deadline) {
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(
+        &op, hyperhotp_program_async(&op, dev, cid, is_8_char_code, serial, seed, deadline, NULL, NULL));
+    if (err != 0) {
         return -1;
     }
+    return hyperhotp_op_wait(&op, cid);
+}
 
-    // Check whether seed is valid
-    for (size_t i = 0; i < HYPERHOTP_SEED_LEN_ASCII; i++) {
-        if (!ascii_is_hex(seed[i])) {
-            log_error("Failed to program device: Seed contains non-hex characters");
-            return -1;
+int hyperhotp_reprogram(USBDevice *dev, FIDOCID cid, const bool is_8_char_code,
+                        const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                        const Deadline *deadline) {
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(
+        &op, hyperhotp_reprogram_async(&op, dev, cid, is_8_char_code, serial, seed, deadline, NULL, NULL));
+    if (err != 0) {
+        return -1;
+    }
+    return hyperhotp_op_wait(&op, cid);
+}
+
+int hyperhotp_wink(USBDevice *dev, FIDOCID cid, const Deadline *deadline) {
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(&op, hyperhotp_wink_async(&op, dev, cid, deadline, NULL, NULL));
+    if (err != 0) {
+        return -1;
+    }
+    return hyperhotp_op_wait(&op, cid);
+}
+
+int hyperhotp_lock(USBDevice *dev, FIDOCID cid, const uint8_t seconds, const Deadline *deadline) {
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(&op, hyperhotp_lock_async(&op, dev, cid, seconds, deadline, NULL, NULL));
+    if (err != 0) {
+        return -1;
+    }
+    return hyperhotp_op_wait(&op, cid);
+}
+
+// Find the key in the session, allocating a channel on it if it's new.
+static HyperhotpKnownKey *hyperhotp_session_key(HyperhotpSession *session, USBDevice *dev, const Deadline *deadline) {
+    FIDOCID cid;
+    if (hyperhotp_session_channel(session, dev, cid, deadline) != 0) {
+        // Classified like a failed submission, so e.g. Ctrl-C isn't reported as an I/O error
+        if (deadline_is_cancelled(deadline)) {
+            HYPERHOTP_LAST_ERROR = FIDO_ERROR_CANCELLED;
+        } else {
+            HYPERHOTP_LAST_ERROR = deadline_expired(deadline) ? FIDO_ERROR_TIMEOUT : FIDO_ERROR_IO;
         }
+        // No operation was started, so there's nothing to report for it
+        memset(&HYPERHOTP_LAST_STATS, 0, sizeof(HyperhotpOpStats));  // NOLINT (GCC doesn't support _s)
+        return NULL;
     }
+    return hyperhotp_session_find(session, &dev->info);
+}
 
-    // Convert seed from ASCII to hex
-    uint8_t hex_seed[HYPERHOTP_SEED_LEN_HEX] = {0};
-    size_t j = 0;
-    for (size_t i = 0; i < HYPERHOTP_SEED_LEN_HEX; i++) {
-        hex_seed[i] = ascii_2_hex(seed[j], seed[j + 1]);
-        j += 2;
+// Drive an operation prepared on the key's channel to completion, keeping the session's knowledge of the key current.
+static int hyperhotp_session_run(HyperhotpOp *op, HyperhotpKnownKey *key) {
+    op->key = key;
+    int err = hyperhotp_op_started(op, hyperhotp_op_run_step(op));
+    if (err != 0) {
+        return -1;
     }
+    return hyperhotp_op_wait(op, key->cid);
+}
 
-    // Send programming request
-    uint8_t data[0x28] = {
-        0x00, 0x09, 0x00, 0x00, 0x23, 0x53, 0x16, 0x01, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x51, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    };  // All non-0 fields are magic
-    if (is_8_char_code) {
-        data[9] = 0x08;
-    } else {
-        data[9] = 0x06;
+int hyperhotp_session_check_programmed(HyperhotpSession *session, USBDevice *dev, char serial[HYPERHOTP_SERIAL_LEN],
+                                       const Deadline *deadline) {
+    HyperhotpKnownKey *key = hyperhotp_session_key(session, dev, deadline);
+    if (key == NULL) {
+        return -1;
+    }
+    HyperhotpOp op;
+    hyperhotp_op_init(&op, HYPERHOTP_OP_CHECK, dev, key->cid, deadline, NULL, NULL);
+    const int programmed = hyperhotp_session_run(&op, key);
+    if (programmed == 1) {
+        memcpy(serial, op.programmed_serial, HYPERHOTP_SERIAL_LEN);  // NOLINT (GCC doesn't support _s)
+    }
+    return programmed;
+}
+
+int hyperhotp_session_reset(HyperhotpSession *session, USBDevice *dev, const Deadline *deadline) {
+    HyperhotpKnownKey *key = hyperhotp_session_key(session, dev, deadline);
+    if (key == NULL) {
+        return -1;
+    }
+    HyperhotpOp op;
+    hyperhotp_op_init(&op, HYPERHOTP_OP_RESET, dev, key->cid, deadline, NULL, NULL);
+    return hyperhotp_session_run(&op, key);
+}
+
+int hyperhotp_session_program(HyperhotpSession *session, USBDevice *dev, const bool is_8_char_code,
+                              const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                              const Deadline *deadline) {
+    HyperhotpKnownKey *key = hyperhotp_session_key(session, dev, deadline);
+    if (key == NULL) {
+        return -1;
     }
-    memcpy(data + 10, hex_seed, HYPERHOTP_SEED_LEN_HEX);  // NOLINT (GCC doesn't support _s)
-    memcpy(data + 32, serial, HYPERHOTP_SERIAL_LEN);      // NOLINT (GCC doesn't support _s)
-    const FIDOInitPacket req = fido_craft_packet(cid, U2FHID_ADPU_RAW, 0x28, data);
-    int err = fido_send_packet(handle, req);
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(&op, hyperhotp_op_init_program(&op, HYPERHOTP_OP_PROGRAM, dev, key->cid,
+                                                                  is_8_char_code, serial, seed, deadline, NULL, NULL));
     if (err != 0) {
         return -1;
     }
+    return hyperhotp_session_run(&op, key);
+}
 
-    // Check whether programming succeeded
-    FIDOInitPacket resp;
-    err = fido_recv_packet(handle, &resp);
+int hyperhotp_session_reprogram(HyperhotpSession *session, USBDevice *dev, const bool is_8_char_code,
+                                const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                                const Deadline *deadline) {
+    HyperhotpKnownKey *key = hyperhotp_session_key(session, dev, deadline);
+    if (key == NULL) {
+        return -1;
+    }
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(&op, hyperhotp_op_init_program(&op, HYPERHOTP_OP_REPROGRAM, dev, key->cid,
+                                                                  is_8_char_code, serial, seed, deadline, NULL, NULL));
     if (err != 0) {
         return -1;
     }
-    char new_serial[HYPERHOTP_SERIAL_LEN] = {0};
-    if (!hyperhotp_transaction_succeeded(resp) || fido_is_error_packet(resp)) {
-        log_error("Failed to program device: Device reported failure (perhaps you didn't push the button?)");
+    return hyperhotp_session_run(&op, key);
+}
+
+int hyperhotp_session_wink(HyperhotpSession *session, USBDevice *dev, const Deadline *deadline) {
+    HyperhotpKnownKey *key = hyperhotp_session_key(session, dev, deadline);
+    if (key == NULL) {
         return -1;
-    } else if (hyperhotp_check_programmed(handle, cid, new_serial) == 0) {
-        log_error(
-            "Failed to program device: Device reported successful programming, but device is not actually programmed");
+    }
+    HyperhotpOp op;
+    hyperhotp_op_init(&op, HYPERHOTP_OP_WINK, dev, key->cid, deadline, NULL, NULL);
+    return hyperhotp_session_run(&op, key);
+}
+
+int hyperhotp_session_lock(HyperhotpSession *session, USBDevice *dev, const uint8_t seconds, const Deadline *deadline) {
+    HyperhotpKnownKey *key = hyperhotp_session_key(session, dev, deadline);
+    if (key == NULL) {
         return -1;
-    } else if (strncmp(serial, new_serial, HYPERHOTP_SERIAL_LEN) != 0) {
-        log_error(
-            "Failed to program device: Device reported successful programming, but serial number doesn't match the one "
-            "programmed. This is a bug in the programmer.");
+    }
+    HyperhotpOp op;
+    int err = hyperhotp_op_started(&op, hyperhotp_op_init_lock(&op, dev, key->cid, seconds, deadline, NULL, NULL));
+    if (err != 0) {
         return -1;
     }
-    return 0;
+    return hyperhotp_session_run(&op, key);
 }
 
-int hyperhotp_cleanup(libusb_device_handle *handle) { return usb_cleanup(handle); }
+void hyperhotp_cancel(Deadline *deadline) { deadline_cancel(deadline); }
+
+int hyperhotp_cleanup(USBDevice *dev) { return usb_cleanup(dev); }
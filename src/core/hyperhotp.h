@@ -2,7 +2,10 @@
 
 #include <libusb.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#include "deadline.h"
 #include "u2fhid.h"
 #include "usb.h"
 
@@ -10,38 +13,338 @@
 #define HYPERHOTP_SEED_LEN_ASCII 40
 #define HYPERHOTP_SEED_LEN_HEX   20
 
+// Length of the payload of the program request
+#define HYPERHOTP_PROGRAM_REQUEST_LEN 0x28
+
+// Number of keys whose channel a session remembers
+#define HYPERHOTP_SESSION_MAX_KEYS 32
+
+/*
+ * All operations which talk to the device take a deadline, after which they give up.
+ * Passing NULL waits forever (e.g. for the user to push the button).
+ */
+
+typedef enum {
+    HYPERHOTP_OP_CHECK,
+    HYPERHOTP_OP_RESET,
+    HYPERHOTP_OP_PROGRAM,
+    HYPERHOTP_OP_WINK,
+    HYPERHOTP_OP_LOCK,
+    HYPERHOTP_OP_REPROGRAM,
+} HyperhotpOpType;
+
+// Requests making up the operations, in the order they're sent. Operations skip those they don't need.
+typedef enum {
+    // This seems to be a magic sequence the Windows client executes before every transaction.
+    HYPERHOTP_STEP_PING,
+    // Query whether the key is programmed
+    HYPERHOTP_STEP_STATUS,
+    // Reset ahead of programming when reprogramming a programmed key, which also waits for the button
+    HYPERHOTP_STEP_RESET,
+    // The actual command, which waits for the button to be pushed in case of reset or program
+    HYPERHOTP_STEP_COMMAND,
+    // Ping and status query again, to verify the command took effect
+    HYPERHOTP_STEP_VERIFY_PING,
+    HYPERHOTP_STEP_VERIFY_STATUS,
+    HYPERHOTP_STEP_COUNT,
+} HyperhotpStep;
+
+// Where the time of (a step of) an operation went.
+typedef struct {
+    // Requests sent, and the USB transfers they took (including retries, and packets meant for other channels)
+    uint32_t exchanges;
+    uint32_t transfers;
+    uint32_t bytes_sent;
+    uint32_t bytes_received;
+    // Waiting for the device to answer, which includes waiting for the button to be pushed
+    uint64_t device_us;
+    // Everything else: Building requests, submitting transfers and handling their completion
+    uint64_t host_us;
+} HyperhotpStats;
+
+typedef struct {
+    HyperhotpStats steps[HYPERHOTP_STEP_COUNT];
+    HyperhotpStats total;
+} HyperhotpOpStats;
+
+// A key seen before in a session, identified by where it's plugged in.
+typedef struct {
+    uint8_t bus;
+    uint8_t port_path[USB_MAX_PORT_DEPTH];
+    uint8_t port_path_len;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    FIDOCID cid;
+    // The ping is an ISO 7816 SELECT of the HOTP applet, which stays selected until the key is reset or programmed
+    bool selected;
+    // Last known result of the status query (see hyperhotp_check_programmed()), -1 if unknown
+    int programmed;
+    char serial[HYPERHOTP_SERIAL_LEN];
+} HyperhotpKnownKey;
+
+typedef struct HyperhotpOp HyperhotpOp;
+
+// Run once an asynchronous operation has finished.
+typedef void (*HyperhotpOpCallback)(HyperhotpOp *op);
+
+// State of an operation running in the background.
+// Many of these can be in flight at once (on different devices), all driven by the context's events.
+struct HyperhotpOp {
+    HyperhotpOpType type;
+    USBDevice *dev;
+    // Channel, which changes if the device had to be re-synced
+    FIDOCID cid;
+    const Deadline *deadline;
+    // Parameters for programming, the request is built once up front
+    char serial[HYPERHOTP_SERIAL_LEN];
+    uint8_t program_request[HYPERHOTP_PROGRAM_REQUEST_LEN];
+    // Parameter for locking
+    uint8_t lock_seconds;
+    // Key known to the session the op runs in, if any, to skip requests whose answer it already knows
+    HyperhotpKnownKey *key;
+    // Internal progress
+    int step;
+    FIDOExchange exchange;
+    // The response to the current step is reassembled into this
+    uint8_t response[FIDO_PACKET_DATA_LEN];
+    // Set while the device signals that it's waiting for the button to be pushed
+    bool waiting_for_button;
+    // Set once finished
+    bool done;
+    // Same meaning as the return value of the corresponding synchronous function
+    int result;
+    // Why the operation failed, if result is -1
+    FIDOError error;
+    // Filled in as the operation goes, complete once it's done
+    HyperhotpOpStats stats;
+    uint64_t started_at_us;
+    uint64_t step_started_at_us;
+    // Serial the key reported as programmed
+    char programmed_serial[HYPERHOTP_SERIAL_LEN];
+    HyperhotpOpCallback callback;
+    void *user_data;
+};
+
+// Remembers the channels allocated on keys, so that talking to a key again doesn't take another channel allocation.
+// A key that has forgotten its channel meanwhile (e.g. because it was replugged) gets a new one on the next operation.
+// Operations run through the session also remember the handshake and whether the key is programmed, which saves the
+// ping and status query most operations would otherwise start with. This assumes nothing else programs or resets the
+// key behind the session's back, hyperhotp_session_forget() makes it ask again.
+typedef struct {
+    USBContext *ctx;
+    HyperhotpKnownKey keys[HYPERHOTP_SESSION_MAX_KEYS];
+    size_t num_keys;
+    // Entry replaced next once all are in use
+    size_t next_evict;
+} HyperhotpSession;
+
+/*
+ * Sets up the state shared by all devices, which should be kept around for as long as the program talks to devices.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_context_init(USBContext **ctx);
+
+/*
+ * Frees the shared state. All devices opened through the context must have been cleaned up before.
+ */
+void hyperhotp_context_cleanup(USBContext *ctx);
+
+/*
+ * Lists all connected devices, so that several of them can be used at once.
+ * The list must be freed with hyperhotp_free_device_list().
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_enumerate(USBContext *ctx, USBDeviceInfo **devices, size_t *count);
+
+void hyperhotp_free_device_list(USBDeviceInfo *devices, const size_t count);
+
 /*
  * Initializes the device, the protocol and allocates a U2FHID channel ID.
+ * Fails if more than one device is connected.
  * Returns 0 on success, -1 on failure.
  * Error message can be obtained from the log module.
  */
-int hyperhotp_init(libusb_device_handle **handle, FIDOCID cid);
+int hyperhotp_init(USBContext *ctx, USBDevice **dev, FIDOCID cid, const Deadline *deadline);
+
+/*
+ * Same as hyperhotp_init(), but for a specific device obtained from hyperhotp_enumerate().
+ * Each device opened this way is independent of all others.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_init_device(USBContext *ctx, const USBDeviceInfo *info, USBDevice **dev, FIDOCID cid,
+                          const Deadline *deadline);
+
+/*
+ * Allocates a U2FHID channel ID on an already opened device, e.g. one reported through usb_hotplug_start().
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_alloc_channel(USBDevice *dev, FIDOCID cid, const Deadline *deadline);
+
+// Starts a session on the context, which has to outlive it. A session is only ever to be used by a single thread.
+void hyperhotp_session_init(HyperhotpSession *session, USBContext *ctx);
+
+/*
+ * Gets a channel on the device: The one remembered for it if the key is known, a newly allocated one otherwise.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_session_channel(HyperhotpSession *session, USBDevice *dev, FIDOCID cid, const Deadline *deadline);
+
+/*
+ * Same as hyperhotp_init_device(), but reconnecting to a known key takes no channel allocation.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_session_open(HyperhotpSession *session, const USBDeviceInfo *info, USBDevice **dev, FIDOCID cid,
+                           const Deadline *deadline);
+
+// Remembers the channel an operation ended up using (see HyperhotpOp.cid), in case it had to re-sync.
+void hyperhotp_session_update(HyperhotpSession *session, const USBDevice *dev, const FIDOCID cid);
+
+// Forgets the key, e.g. once it has been unplugged.
+void hyperhotp_session_forget(HyperhotpSession *session, const USBDevice *dev);
+
+/*
+ * Same as the synchronous operations below, but on the session's channel for the key (allocated if the key is new to
+ * the session), sending the ping and status query only if the session doesn't know their answer yet.
+ * The status query of hyperhotp_session_check_programmed() and the one verifying a reset or program are always sent.
+ */
+int hyperhotp_session_check_programmed(HyperhotpSession *session, USBDevice *dev, char serial[HYPERHOTP_SERIAL_LEN],
+                                       const Deadline *deadline);
+
+int hyperhotp_session_reset(HyperhotpSession *session, USBDevice *dev, const Deadline *deadline);
+
+int hyperhotp_session_program(HyperhotpSession *session, USBDevice *dev, const bool is_8_char_code,
+                              const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                              const Deadline *deadline);
+
+int hyperhotp_session_reprogram(HyperhotpSession *session, USBDevice *dev, const bool is_8_char_code,
+                                const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                                const Deadline *deadline);
+
+int hyperhotp_session_wink(HyperhotpSession *session, USBDevice *dev, const Deadline *deadline);
+
+int hyperhotp_session_lock(HyperhotpSession *session, USBDevice *dev, const uint8_t seconds, const Deadline *deadline);
+
+/*
+ * The synchronous operations below update cid if they had to allocate a new channel, for the next one to use.
+ * If they fail, hyperhotp_get_last_error() tells why, and fido_error_is_retryable() whether trying again can help.
+ */
+
+// Why the calling thread's last synchronous operation failed, FIDO_ERROR_NONE if it didn't.
+FIDOError hyperhotp_get_last_error(void);
+
+/*
+ * Transfers and time taken by the calling thread's last synchronous operation, per step (all 0 if it couldn't be
+ * started).
+ */
+void hyperhotp_get_last_stats(HyperhotpOpStats *stats);
+
+// Short name of the step, e.g. for printing stats.
+const char *hyperhotp_step_name(const HyperhotpStep step);
 
 /*
  * Checks whether the device has been programmed, and returns the HOTP key's serial if yes.
  * Returns 1 if programmed, 0 if not programmed, -1 on failure.
  * Error message can be obtained from the log module.
  */
-int hyperhotp_check_programmed(libusb_device_handle *handle, const FIDOCID cid, char serial[HYPERHOTP_SERIAL_LEN]);
+int hyperhotp_check_programmed(USBDevice *dev, FIDOCID cid, char serial[HYPERHOTP_SERIAL_LEN],
+                               const Deadline *deadline);
 
 /*
  * Resets the device, clearing any HOTP data.
  * Returns 0 on success, -1 on failure.
  * Error message can be obtained from the log module.
  */
-int hyperhotp_reset(libusb_device_handle *handle, const FIDOCID cid);
+int hyperhotp_reset(USBDevice *dev, FIDOCID cid, const Deadline *deadline);
 
 /*
  * Programs the device.
  * Returns 0 on success, -1 on failure.
  * Error message can be obtained from the log module.
  */
-int hyperhotp_program(libusb_device_handle *handle, const FIDOCID cid, const bool is_8_char_code,
-                      const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII]);
+int hyperhotp_program(USBDevice *dev, FIDOCID cid, const bool is_8_char_code, const char serial[HYPERHOTP_SERIAL_LEN],
+                      const char seed[HYPERHOTP_SEED_LEN_ASCII], const Deadline *deadline);
+
+/*
+ * Resets the device if it's programmed, then programs it, to re-issue a key in one go.
+ * Saves the status queries between the two, the final one verifies the serial. The button has to be pushed for each.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_reprogram(USBDevice *dev, FIDOCID cid, const bool is_8_char_code,
+                        const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                        const Deadline *deadline);
+
+/*
+ * Makes the key signal its location (e.g. by blinking), to tell it apart from others connected at the same time.
+ * Returns 0 on success, -1 on failure (e.g. if the key doesn't support winking).
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_wink(USBDevice *dev, FIDOCID cid, const Deadline *deadline);
+
+/*
+ * Reserves the key for this channel for the given number of seconds (up to U2FHID_MAX_LOCK_SECONDS), during which other
+ * U2F clients get told it's busy. Renew the lock to hold it for longer, 0 releases it.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_lock(USBDevice *dev, FIDOCID cid, const uint8_t seconds, const Deadline *deadline);
+
+/*
+ * Asynchronous versions of the above. Instead of blocking, they return once the first request is on its way.
+ * The callback is run from hyperhotp_process_events() once the operation is done, with op->result holding what the
+ * synchronous function would have returned and op->error telling why it failed. The op and deadline must stay valid
+ * until then.
+ * Returns 0 if the operation was started, -1 on failure (in which case the callback isn't run, but op->error is set).
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_check_programmed_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const Deadline *deadline,
+                                     HyperhotpOpCallback callback, void *user_data);
+
+int hyperhotp_reset_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const Deadline *deadline,
+                          HyperhotpOpCallback callback, void *user_data);
+
+int hyperhotp_program_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const bool is_8_char_code,
+                            const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                            const Deadline *deadline, HyperhotpOpCallback callback, void *user_data);
+
+int hyperhotp_reprogram_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const bool is_8_char_code,
+                              const char serial[HYPERHOTP_SERIAL_LEN], const char seed[HYPERHOTP_SEED_LEN_ASCII],
+                              const Deadline *deadline, HyperhotpOpCallback callback, void *user_data);
+
+int hyperhotp_wink_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const Deadline *deadline,
+                         HyperhotpOpCallback callback, void *user_data);
+
+int hyperhotp_lock_async(HyperhotpOp *op, USBDevice *dev, const FIDOCID cid, const uint8_t seconds,
+                         const Deadline *deadline, HyperhotpOpCallback callback, void *user_data);
+
+// Abort an asynchronous operation. Its callback still gets run, with a failed result.
+void hyperhotp_op_cancel(HyperhotpOp *op);
+
+/*
+ * Advance all asynchronous operations on the context without blocking.
+ * To run inside an external event loop, watch the descriptors from usb_context_get_pollfds() and call this whenever
+ * one becomes ready, or usb_context_next_timeout() has expired.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_process_events(USBContext *ctx);
+
+/*
+ * Aborts whichever operation is currently running under the given deadline.
+ * The operation then fails as soon as possible.
+ * Safe to call from other threads and from signal handlers.
+ */
+void hyperhotp_cancel(Deadline *deadline);
 
 /*
- * Cleans up resources.
+ * Closes the device.
  * Returns 0 on success, -1 on failure.
  * Error message can be obtained from the log module.
  */
-int hyperhotp_cleanup(libusb_device_handle *handle);
+int hyperhotp_cleanup(USBDevice *dev);
@@ -0,0 +1,274 @@
+#include "hyperhotp_io.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deadline.h"
+#include "hyperhotp.h"
+#include "log.h"
+#include "spsc_queue.h"
+#include "usb.h"
+#include "usb_async.h"
+
+// Errors are logged per thread, so this only sees what went wrong on the I/O thread itself.
+static void hyperhotp_io_capture_error(HyperhotpCommand *cmd) {
+    char *msg = log_get_last_error_string();
+    snprintf(cmd->error, HYPERHOTP_IO_ERROR_LEN, "%s", msg);
+    log_free_error_string(msg);
+}
+
+static void hyperhotp_io_complete(HyperhotpIODevice *io_dev, HyperhotpCommand *cmd) {
+    cmd->done = true;
+    // Can't fail, hyperhotp_io_post() doesn't let more commands in than fit
+    spsc_queue_push(&io_dev->completions, cmd);
+    if (io_dev->notify != NULL) {
+        io_dev->notify(io_dev, io_dev->user_data);
+    }
+}
+
+static void hyperhotp_io_op_done(HyperhotpOp *op) {
+    HyperhotpIODevice *io_dev = (HyperhotpIODevice *)op->user_data;
+    HyperhotpCommand *cmd = io_dev->active;
+    io_dev->active = NULL;
+    // Later commands have to use the channel the op ended up on
+    memcpy(io_dev->cid, op->cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+    cmd->result = op->result;
+    cmd->stats = op->stats;
+    if (op->result == 1) {
+        memcpy(cmd->programmed_serial, op->programmed_serial, HYPERHOTP_SERIAL_LEN);  // NOLINT (GCC doesn't support _s)
+    } else if (op->result == -1) {
+        cmd->error_code = op->error;
+        hyperhotp_io_capture_error(cmd);
+    }
+    hyperhotp_io_complete(io_dev, cmd);
+}
+
+static void hyperhotp_io_start_command(HyperhotpIODevice *io_dev, HyperhotpCommand *cmd) {
+    // So an earlier command's error can't be passed off as this one's
+    log_clear_error();
+    int err = 0;
+    switch (cmd->type) {
+        case HYPERHOTP_OP_CHECK:
+            err = hyperhotp_check_programmed_async(&cmd->op, io_dev->dev, io_dev->cid, cmd->deadline,
+                                                   hyperhotp_io_op_done, io_dev);
+            break;
+        case HYPERHOTP_OP_RESET:
+            err = hyperhotp_reset_async(&cmd->op, io_dev->dev, io_dev->cid, cmd->deadline, hyperhotp_io_op_done,
+                                        io_dev);
+            break;
+        case HYPERHOTP_OP_PROGRAM:
+            err = hyperhotp_program_async(&cmd->op, io_dev->dev, io_dev->cid, cmd->is_8_char_code, cmd->serial,
+                                          cmd->seed, cmd->deadline, hyperhotp_io_op_done, io_dev);
+            break;
+        case HYPERHOTP_OP_REPROGRAM:
+            err = hyperhotp_reprogram_async(&cmd->op, io_dev->dev, io_dev->cid, cmd->is_8_char_code, cmd->serial,
+                                            cmd->seed, cmd->deadline, hyperhotp_io_op_done, io_dev);
+            break;
+        case HYPERHOTP_OP_WINK:
+            err = hyperhotp_wink_async(&cmd->op, io_dev->dev, io_dev->cid, cmd->deadline, hyperhotp_io_op_done, io_dev);
+            break;
+        case HYPERHOTP_OP_LOCK:
+            err = hyperhotp_lock_async(&cmd->op, io_dev->dev, io_dev->cid, cmd->lock_seconds, cmd->deadline,
+                                       hyperhotp_io_op_done, io_dev);
+            break;
+        default:
+            log_error("Failed to run command: Unknown command type");
+            cmd->op.error = FIDO_ERROR_INVALID_ARGUMENT;
+            err = -1;
+            break;
+    }
+    if (err != 0) {
+        cmd->result = -1;
+        cmd->error_code = cmd->op.error;
+        hyperhotp_io_capture_error(cmd);
+        hyperhotp_io_complete(io_dev, cmd);
+        return;
+    }
+    io_dev->active = cmd;
+    io_dev->cancelling = false;
+}
+
+// Give the device back to its owner once nothing is running on it anymore.
+static void hyperhotp_io_release(HyperhotpIO *io, const size_t slot, HyperhotpIODevice *io_dev) {
+    atomic_store(&io->devices[slot], NULL);
+    pthread_mutex_lock(&io->lock);
+    io_dev->detached = true;
+    pthread_cond_broadcast(&io->detached);
+    pthread_mutex_unlock(&io->lock);
+}
+
+// Start, abort or finish up commands of a device. Returns true while a command is running on it.
+static bool hyperhotp_io_service(HyperhotpIO *io, const size_t slot, HyperhotpIODevice *io_dev, const bool stopping) {
+    const bool leaving = stopping || atomic_load(&io_dev->detach_requested);
+    if (io_dev->active != NULL) {
+        const HyperhotpCommand *cmd = io_dev->active;
+        if (!io_dev->cancelling && (leaving || deadline_expired(cmd->deadline))) {
+            hyperhotp_op_cancel(&io_dev->active->op);
+            io_dev->cancelling = true;
+        }
+        return true;
+    }
+    if (leaving) {
+        // Whatever is still queued never runs, and is handed back through hyperhotp_io_detach()
+        if (atomic_load(&io_dev->detach_requested)) {
+            hyperhotp_io_release(io, slot, io_dev);
+        }
+        return false;
+    }
+    HyperhotpCommand *cmd = (HyperhotpCommand *)spsc_queue_pop(&io_dev->commands);
+    if (cmd != NULL) {
+        hyperhotp_io_start_command(io_dev, cmd);
+    }
+    return io_dev->active != NULL;
+}
+
+static void *hyperhotp_io_run(void *arg) {
+    HyperhotpIO *io = (HyperhotpIO *)arg;
+    while (true) {
+        const bool stopping = atomic_load(&io->stop);
+        bool busy = false;
+        for (size_t i = 0; i < HYPERHOTP_IO_MAX_DEVICES; i++) {
+            HyperhotpIODevice *io_dev = atomic_load(&io->devices[i]);
+            if (io_dev != NULL && hyperhotp_io_service(io, i, io_dev, stopping)) {
+                busy = true;
+            }
+        }
+        if (stopping && !busy) {
+            break;
+        }
+        // Posting a command interrupts this, so the interval only bounds how quickly deadlines are noticed
+        if (usb_context_handle_events(io->ctx, USB_ASYNC_POLL_INTERVAL_MS) != 0) {
+            log_debug("Failed to handle USB events on the I/O thread");
+        }
+    }
+    log_clear_error();
+    return NULL;
+}
+
+int hyperhotp_io_start(USBContext *ctx, HyperhotpIO **io) {
+    *io = NULL;
+    HyperhotpIO *i = (HyperhotpIO *)calloc(1, sizeof(HyperhotpIO));
+    if (i == NULL) {
+        log_error("Failed to start I/O thread: Out of memory");
+        return -1;
+    }
+    i->ctx = ctx;
+    atomic_init(&i->stop, false);
+    for (size_t j = 0; j < HYPERHOTP_IO_MAX_DEVICES; j++) {
+        atomic_init(&i->devices[j], NULL);
+    }
+    pthread_mutex_init(&i->lock, NULL);
+    pthread_cond_init(&i->detached, NULL);
+
+    int err = pthread_create(&i->thread, NULL, hyperhotp_io_run, i);
+    if (err != 0) {
+        pthread_cond_destroy(&i->detached);
+        pthread_mutex_destroy(&i->lock);
+        free(i);
+        log_error("Failed to start I/O thread: pthread_create() failed");
+        return -1;
+    }
+    i->running = true;
+    *io = i;
+    return 0;
+}
+
+void hyperhotp_io_stop(HyperhotpIO *io) {
+    if (io == NULL) {
+        return;
+    }
+    atomic_store(&io->stop, true);
+    usb_context_wake(io->ctx);
+    pthread_join(io->thread, NULL);
+    io->running = false;
+    for (size_t i = 0; i < HYPERHOTP_IO_MAX_DEVICES; i++) {
+        HyperhotpIODevice *io_dev = atomic_load(&io->devices[i]);
+        if (io_dev != NULL) {
+            hyperhotp_io_detach(io, io_dev);
+        }
+    }
+    pthread_cond_destroy(&io->detached);
+    pthread_mutex_destroy(&io->lock);
+    free(io);
+}
+
+int hyperhotp_io_attach(HyperhotpIO *io, USBDevice *dev, const FIDOCID cid, HyperhotpIONotifyCallback notify,
+                        void *user_data, HyperhotpIODevice **io_dev) {
+    *io_dev = NULL;
+    HyperhotpIODevice *d = (HyperhotpIODevice *)calloc(1, sizeof(HyperhotpIODevice));
+    if (d == NULL) {
+        log_error("Failed to attach device: Out of memory");
+        return -1;
+    }
+    d->dev = dev;
+    memcpy(d->cid, cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+    spsc_queue_init(&d->commands);
+    spsc_queue_init(&d->completions);
+    d->notify = notify;
+    d->user_data = user_data;
+    atomic_init(&d->detach_requested, false);
+
+    for (size_t i = 0; i < HYPERHOTP_IO_MAX_DEVICES; i++) {
+        HyperhotpIODevice *expected = NULL;
+        if (atomic_compare_exchange_strong(&io->devices[i], &expected, d)) {
+            *io_dev = d;
+            return 0;
+        }
+    }
+    free(d);
+    log_error("Failed to attach device: Too many devices");
+    return -1;
+}
+
+void hyperhotp_io_detach(HyperhotpIO *io, HyperhotpIODevice *io_dev) {
+    if (io->running) {
+        atomic_store(&io_dev->detach_requested, true);
+        usb_context_wake(io->ctx);
+        pthread_mutex_lock(&io->lock);
+        while (!io_dev->detached) {
+            pthread_cond_wait(&io->detached, &io->lock);
+        }
+        pthread_mutex_unlock(&io->lock);
+    } else {
+        for (size_t i = 0; i < HYPERHOTP_IO_MAX_DEVICES; i++) {
+            HyperhotpIODevice *expected = io_dev;
+            atomic_compare_exchange_strong(&io->devices[i], &expected, NULL);
+        }
+    }
+    // Commands that never ran keep done set to false
+    while (spsc_queue_pop(&io_dev->commands) != NULL) {
+    }
+    free(io_dev);
+}
+
+int hyperhotp_io_post(HyperhotpIO *io, HyperhotpIODevice *io_dev, HyperhotpCommand *cmd) {
+    if (io_dev->outstanding == SPSC_QUEUE_CAPACITY) {
+        log_error("Failed to post command: Too many commands in flight");
+        return -1;
+    }
+    cmd->done = false;
+    cmd->result = -1;
+    cmd->error[0] = '\0';
+    cmd->error_code = FIDO_ERROR_NONE;
+    memset(&cmd->stats, 0, sizeof(HyperhotpOpStats));  // NOLINT (GCC doesn't support _s)
+    if (!spsc_queue_push(&io_dev->commands, cmd)) {
+        log_error("Failed to post command: Queue is full");
+        return -1;
+    }
+    io_dev->outstanding++;
+    // Wake the I/O thread up, so it doesn't wait for its next poll interval
+    usb_context_wake(io->ctx);
+    return 0;
+}
+
+HyperhotpCommand *hyperhotp_io_poll(HyperhotpIODevice *io_dev) {
+    HyperhotpCommand *cmd = (HyperhotpCommand *)spsc_queue_pop(&io_dev->completions);
+    if (cmd != NULL) {
+        io_dev->outstanding--;
+    }
+    return cmd;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "deadline.h"
+#include "hyperhotp.h"
+#include "spsc_queue.h"
+#include "u2fhid.h"
+#include "usb.h"
+
+// Maximum number of devices a single I/O thread serves
+#define HYPERHOTP_IO_MAX_DEVICES 16
+
+// Room for the error message of a failed command
+#define HYPERHOTP_IO_ERROR_LEN 256
+
+/*
+ * Threading mode: A single thread owns the context, handles all of its libusb events and performs all device I/O.
+ * Other threads post commands to a device's queue and collect them back once they're done.
+ * Posting and collecting are lock-free, so they can be done from e.g. a GUI's render loop.
+ */
+
+// A request of any of the operation types, owned by the posting thread.
+// It must stay valid, and must not be touched, from being posted until it has been collected again.
+typedef struct {
+    HyperhotpOpType type;
+    // Parameters for programming and reprogramming
+    bool is_8_char_code;
+    char serial[HYPERHOTP_SERIAL_LEN];
+    char seed[HYPERHOTP_SEED_LEN_ASCII];
+    // Parameter for locking
+    uint8_t lock_seconds;
+    // May be cancelled from any thread to abort the command, NULL waits forever
+    const Deadline *deadline;
+    void *user_data;
+    // Set by the I/O thread once done
+    bool done;
+    // Same meaning as the return value of the corresponding synchronous function
+    int result;
+    char programmed_serial[HYPERHOTP_SERIAL_LEN];
+    // Why the command failed, as the log module reported it on the I/O thread
+    char error[HYPERHOTP_IO_ERROR_LEN];
+    // The same, for deciding whether to post the command again
+    FIDOError error_code;
+    // Transfers and time the command took, see HyperhotpOp.stats
+    HyperhotpOpStats stats;
+    // Used by the I/O thread
+    HyperhotpOp op;
+} HyperhotpCommand;
+
+typedef struct HyperhotpIODevice HyperhotpIODevice;
+
+// Run on the I/O thread whenever a command has completed, e.g. to wake up the thread that collects them.
+typedef void (*HyperhotpIONotifyCallback)(HyperhotpIODevice *dev, void *user_data);
+
+// A device served by the I/O thread.
+struct HyperhotpIODevice {
+    USBDevice *dev;
+    FIDOCID cid;
+    // Posted commands, from the owning thread to the I/O thread
+    SPSCQueue commands;
+    // Completed commands, from the I/O thread back to the owning thread
+    SPSCQueue completions;
+    // Commands posted but not collected yet, only touched by the owning thread
+    size_t outstanding;
+    HyperhotpIONotifyCallback notify;
+    void *user_data;
+    // I/O thread state
+    HyperhotpCommand *active;
+    bool cancelling;
+    atomic_bool detach_requested;
+    bool detached;
+};
+
+typedef struct {
+    USBContext *ctx;
+    pthread_t thread;
+    bool running;
+    atomic_bool stop;
+    _Atomic(HyperhotpIODevice *) devices[HYPERHOTP_IO_MAX_DEVICES];
+    // Only used to wait for the I/O thread to let go of a device, never on the command path
+    pthread_mutex_t lock;
+    pthread_cond_t detached;
+} HyperhotpIO;
+
+/*
+ * Start the I/O thread. From then on only the I/O thread may handle events on the context or talk to attached
+ * devices, until hyperhotp_io_stop() has returned.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_io_start(USBContext *ctx, HyperhotpIO **io);
+
+/*
+ * Abort all commands, wait for the I/O thread to exit and free it. Devices still attached are detached.
+ */
+void hyperhotp_io_stop(HyperhotpIO *io);
+
+/*
+ * Hand an opened device with an allocated channel over to the I/O thread.
+ * Commands for it must be posted and collected from a single thread (the device's owner).
+ * notify is optional.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_io_attach(HyperhotpIO *io, USBDevice *dev, const FIDOCID cid, HyperhotpIONotifyCallback notify,
+                        void *user_data, HyperhotpIODevice **io_dev);
+
+/*
+ * Take a device back from the I/O thread and free io_dev, after which the device may be used directly again.
+ * A running command is aborted. Commands that didn't finish have done set to false.
+ */
+void hyperhotp_io_detach(HyperhotpIO *io, HyperhotpIODevice *io_dev);
+
+/*
+ * Queue a command for the device. Fails if too many commands haven't been collected yet.
+ * Returns 0 on success, -1 on failure.
+ * Error message can be obtained from the log module.
+ */
+int hyperhotp_io_post(HyperhotpIO *io, HyperhotpIODevice *io_dev, HyperhotpCommand *cmd);
+
+/*
+ * Collect the oldest completed command of the device.
+ * Returns NULL if none has completed.
+ */
+HyperhotpCommand *hyperhotp_io_poll(HyperhotpIODevice *io_dev);
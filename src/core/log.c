@@ -6,8 +6,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-// Pointer to the last error string.
-static char *LOG_LAST_ERROR_STRING = NULL;
+// Pointer to the last error string. Each thread has its own, so threads can't see or overwrite each other's errors.
+static _Thread_local char *LOG_LAST_ERROR_STRING = NULL;
 
 #define MAX_LIBUSB_ERR_LEN 8192
 
@@ -15,6 +15,7 @@ void log_error(const char *msg) {
     const size_t len = strlen(msg) + 1;
     char *err_str = (char *)malloc(len * sizeof(char));
     strncpy(err_str, msg, (unsigned long)len);
+    free(LOG_LAST_ERROR_STRING);
     LOG_LAST_ERROR_STRING = err_str;
 // Also log to stderr (useful for debugging the error message mechanism itself)
 #ifdef DEBUG
@@ -26,18 +27,26 @@ void log_error(const char *msg) {
 void log_error_libusb(const char *msg, const int libusb_err) {
     char *err_str = (char *)malloc(MAX_LIBUSB_ERR_LEN * sizeof(char));
     snprintf(err_str, MAX_LIBUSB_ERR_LEN, "%s: Libusb says: \"%s\"\n", msg, libusb_strerror(libusb_err));
+    free(LOG_LAST_ERROR_STRING);
     LOG_LAST_ERROR_STRING = err_str;
 }
 
 char *log_get_last_error_string(void) {
-    const size_t len = strlen(LOG_LAST_ERROR_STRING) + 1;
+    // Nothing has failed on this thread yet
+    const char *last = LOG_LAST_ERROR_STRING != NULL ? LOG_LAST_ERROR_STRING : "";
+    const size_t len = strlen(last) + 1;
     char *copy = (char *)malloc(len * sizeof(char));
-    strncpy(copy, LOG_LAST_ERROR_STRING, (unsigned long)len);
+    strncpy(copy, last, (unsigned long)len);
     copy[len - 1] = '\0';
 
     return copy;
 }
 
+void log_clear_error(void) {
+    free(LOG_LAST_ERROR_STRING);
+    LOG_LAST_ERROR_STRING = NULL;
+}
+
 void log_free_error_string(char *str) {
     free(str);
     str = NULL;
@@ -5,10 +5,13 @@
 
 void log_fatal(const char* msg);
 
+// The last error is kept per thread: log_get_last_error_string() returns the one logged by the calling thread.
 void log_error(const char* msg);
 void log_error_libusb(const char* msg, const int libusb_err);
 char* log_get_last_error_string(void);
 void log_free_error_string(char* str);
+// Forget the calling thread's last error, freeing it.
+void log_clear_error(void);
 
 void log_debug(const char* msg);
 
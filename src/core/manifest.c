@@ -0,0 +1,265 @@
+#include "manifest.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "seed.h"
+
+// Characters a seed takes up in a text format
+static size_t manifest_seed_chars(const ManifestFormat format) {
+    return format == MANIFEST_FORMAT_BASE32 ? SEED_LEN_BASE32 : SEED_LEN_ASCII;
+}
+
+// Stands in for the characters of a line that isn't a valid seed, decodes to zeroes
+static char manifest_filler_char(const ManifestFormat format) { return format == MANIFEST_FORMAT_BASE32 ? 'A' : '0'; }
+
+void manifest_parser_init(ManifestParser *parser, const ManifestFormat format, ManifestCallback callback,
+                          void *user_data) {
+    memset(parser, 0, sizeof(*parser));  // NOLINT (GCC doesn't support _s)
+    parser->format = format;
+    parser->callback = callback;
+    parser->user_data = user_data;
+    parser->line = 1;
+    parser->line_error = SEED_OK;
+}
+
+static void manifest_emit(ManifestParser *parser, const uint8_t *seed, const SeedStatus status, const size_t record) {
+    parser->num_seeds++;
+    if (status != SEED_OK) {
+        parser->num_invalid++;
+    }
+    parser->callback(seed, status, record, parser->user_data);
+}
+
+// Decode the seeds in the batch and pass them on.
+static void manifest_flush(ManifestParser *parser) {
+    if (parser->batch_len == 0) {
+        return;
+    }
+    if (parser->format == MANIFEST_FORMAT_BASE32) {
+        seed_decode_base32_bulk(parser->chars, parser->batch_len, parser->seeds, parser->status);
+    } else {
+        seed_decode_bulk(parser->chars, parser->batch_len, parser->seeds, parser->status);
+    }
+    for (size_t i = 0; i < parser->batch_len; i++) {
+        const SeedStatus status = parser->line_status[i] != SEED_OK ? parser->line_status[i] : parser->status[i];
+        manifest_emit(parser, parser->seeds + i * SEED_LEN, status, parser->records[i]);
+    }
+    parser->batch_len = 0;
+}
+
+// Queue the characters of a seed for decoding, given any problem with the line they're on.
+static void manifest_queue_line(ManifestParser *parser, const char *chars, const SeedStatus status) {
+    const size_t seed_chars = manifest_seed_chars(parser->format);
+    char *slot = parser->chars + parser->batch_len * seed_chars;
+    if (status == SEED_OK) {
+        memcpy(slot, chars, seed_chars);                                // NOLINT (GCC doesn't support _s)
+    } else {
+        memset(slot, manifest_filler_char(parser->format), seed_chars);  // NOLINT (GCC doesn't support _s)
+    }
+    parser->line_status[parser->batch_len] = status;
+    parser->records[parser->batch_len] = parser->line;
+    parser->batch_len++;
+    if (parser->batch_len == MANIFEST_BATCH_SIZE) {
+        manifest_flush(parser);
+    }
+}
+
+static void manifest_end_line(ManifestParser *parser) {
+    const bool is_blank = parser->line_len == 0 && !parser->line_has_padding && parser->line_error == SEED_OK;
+    if (!parser->line_is_comment && !is_blank) {
+        SeedStatus status = parser->line_error;
+        if (status == SEED_OK && parser->line_len != manifest_seed_chars(parser->format)) {
+            status = SEED_ERR_LENGTH;
+        }
+        manifest_queue_line(parser, parser->line_chars, status);
+    }
+    parser->line++;
+    parser->line_len = 0;
+    parser->line_is_comment = false;
+    parser->line_has_padding = false;
+    parser->line_error = SEED_OK;
+}
+
+// Add a character of the line being read, skipping the ones that aren't part of the seed.
+static void manifest_add_char(ManifestParser *parser, const char c) {
+    if (parser->line_is_comment || c == ' ' || c == '\t' || c == '\r') {
+        return;
+    }
+    if (c == '#' && parser->line_len == 0 && !parser->line_has_padding) {
+        parser->line_is_comment = true;
+        return;
+    }
+    if (parser->format == MANIFEST_FORMAT_BASE32) {
+        if (c == '=') {
+            parser->line_has_padding = true;
+            return;
+        }
+        // Padding only goes at the end
+        if (parser->line_has_padding) {
+            parser->line_error = SEED_ERR_NOT_BASE32;
+        }
+    }
+    // Characters past the end of a seed are only counted, to tell that the line is too long
+    const size_t seed_chars = manifest_seed_chars(parser->format);
+    if (parser->line_len < seed_chars) {
+        parser->line_chars[parser->line_len] = c;
+    }
+    parser->line_len++;
+}
+
+// Whether any byte of x is zero.
+static uint64_t manifest_has_zero_byte(const uint64_t x) {
+    return (x - UINT64_C(0x0101010101010101)) & ~x & UINT64_C(0x8080808080808080);
+}
+
+// Whether any byte of x is c.
+static uint64_t manifest_has_byte(const uint64_t x, const char c) {
+    return manifest_has_zero_byte(x ^ (UINT64_C(0x0101010101010101) * (uint8_t)c));
+}
+
+/*
+ * Whether none of the characters of a seed are ones manifest_add_char() skips or treats specially.
+ * Checks 8 characters at a time, and all of them rather than stopping at the first, so that the time taken doesn't
+ * depend on the seed.
+ */
+static bool manifest_is_plain(const char *chars, const size_t len) {
+    _Static_assert(SEED_LEN_ASCII % 8 == 0 && SEED_LEN_BASE32 % 8 == 0, "Seeds are checked 8 characters at a time");
+    uint64_t special = 0;
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t x = 0;
+        memcpy(&x, chars + i, sizeof(x));  // NOLINT (GCC doesn't support _s)
+        special |= manifest_has_byte(x, ' ') | manifest_has_byte(x, '\t') | manifest_has_byte(x, '\r') |
+                   manifest_has_byte(x, '#') | manifest_has_byte(x, '=');
+    }
+    return special == 0;
+}
+
+static void manifest_feed_text(ManifestParser *parser, const char *data, size_t len) {
+    const size_t seed_chars = manifest_seed_chars(parser->format);
+    while (len > 0) {
+        const char *newline = (const char *)memchr(data, '\n', len);
+        const size_t line_len = newline != NULL ? (size_t)(newline - data) : len;
+        const bool at_line_start = parser->line_len == 0 && !parser->line_is_comment && !parser->line_has_padding &&
+                                   parser->line_error == SEED_OK;
+        // Common case: A whole line holding just a seed, which is queued as is and left to the decoder to check.
+        // Lines with characters that are skipped go the slow way, so they're reported the same wherever chunks end.
+        if (newline != NULL && at_line_start &&
+            (line_len == seed_chars || (line_len == seed_chars + 1 && data[seed_chars] == '\r')) &&
+            manifest_is_plain(data, seed_chars)) {
+            manifest_queue_line(parser, data, SEED_OK);
+            parser->line++;
+        } else {
+            for (size_t i = 0; i < line_len; i++) {
+                manifest_add_char(parser, data[i]);
+            }
+            if (newline != NULL) {
+                manifest_end_line(parser);
+            }
+        }
+        const size_t consumed = newline != NULL ? line_len + 1 : line_len;
+        data += consumed;
+        len -= consumed;
+    }
+}
+
+static void manifest_feed_raw(ManifestParser *parser, const uint8_t *data, size_t len) {
+    // Complete a seed split across chunks first
+    if (parser->partial_len > 0) {
+        const size_t missing = SEED_LEN - parser->partial_len;
+        const size_t n = len < missing ? len : missing;
+        memcpy(parser->partial + parser->partial_len, data, n);  // NOLINT (GCC doesn't support _s)
+        parser->partial_len += n;
+        data += n;
+        len -= n;
+        if (parser->partial_len < SEED_LEN) {
+            return;
+        }
+        manifest_emit(parser, parser->partial, SEED_OK, parser->num_seeds + 1);
+        parser->partial_len = 0;
+    }
+    // Raw seeds need no decoding, so they're passed on straight from the chunk
+    for (; len >= SEED_LEN; data += SEED_LEN, len -= SEED_LEN) {
+        manifest_emit(parser, data, SEED_OK, parser->num_seeds + 1);
+    }
+    memcpy(parser->partial, data, len);  // NOLINT (GCC doesn't support _s)
+    parser->partial_len = len;
+}
+
+void manifest_parser_feed(ManifestParser *parser, const void *data, const size_t len) {
+    if (parser->format == MANIFEST_FORMAT_RAW) {
+        manifest_feed_raw(parser, (const uint8_t *)data, len);
+    } else {
+        manifest_feed_text(parser, (const char *)data, len);
+        manifest_flush(parser);
+    }
+}
+
+void manifest_parser_finish(ManifestParser *parser) {
+    if (parser->format == MANIFEST_FORMAT_RAW) {
+        if (parser->partial_len > 0) {
+            const uint8_t zeroes[SEED_LEN] = {0};
+            manifest_emit(parser, zeroes, SEED_ERR_LENGTH, parser->num_seeds + 1);
+            parser->partial_len = 0;
+        }
+        return;
+    }
+    // The last line may lack a newline
+    if (parser->line_len > 0 || parser->line_has_padding || parser->line_error != SEED_OK) {
+        manifest_end_line(parser);
+    }
+    manifest_flush(parser);
+}
+
+int manifest_parse_file(FILE *file, const ManifestFormat format, ManifestCallback callback, void *user_data,
+                        size_t *num_seeds, size_t *num_invalid) {
+    ManifestParser *parser = (ManifestParser *)calloc(1, sizeof(ManifestParser));
+    uint8_t *buf = (uint8_t *)malloc(MANIFEST_READ_SIZE);
+    if (parser == NULL || buf == NULL) {
+        free(parser);
+        free(buf);
+        log_error("Failed to parse manifest: Out of memory");
+        return -1;
+    }
+
+    manifest_parser_init(parser, format, callback, user_data);
+    size_t len = 0;
+    while ((len = fread(buf, 1, MANIFEST_READ_SIZE, file)) > 0) {
+        manifest_parser_feed(parser, buf, len);
+    }
+    int result = 0;
+    if (ferror(file)) {
+        log_error("Failed to parse manifest: Failed to read file");
+        result = -1;
+    } else {
+        manifest_parser_finish(parser);
+    }
+
+    if (num_seeds != NULL) {
+        *num_seeds = parser->num_seeds;
+    }
+    if (num_invalid != NULL) {
+        *num_invalid = parser->num_invalid;
+    }
+    free(parser);
+    free(buf);
+    return result;
+}
+
+int manifest_format_from_string(const char *name, ManifestFormat *format) {
+    if (strncmp(name, "hex", 100) == 0) {
+        *format = MANIFEST_FORMAT_HEX;
+    } else if (strncmp(name, "base32", 100) == 0) {
+        *format = MANIFEST_FORMAT_BASE32;
+    } else if (strncmp(name, "raw", 100) == 0) {
+        *format = MANIFEST_FORMAT_RAW;
+    } else {
+        return -1;
+    }
+    return 0;
+}
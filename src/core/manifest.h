@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "seed.h"
+
+// Seeds decoded at once, the parser's memory use is proportional to this and independent of the manifest's size
+#define MANIFEST_BATCH_SIZE 64
+
+// How much of a manifest file is read at once
+#define MANIFEST_READ_SIZE 65536
+
+typedef enum {
+    // One seed of SEED_LEN_ASCII hexadecimal characters per line, as taken by hyperhotp_program()
+    MANIFEST_FORMAT_HEX,
+    // One seed of SEED_LEN_BASE32 RFC 4648 base32 characters per line, as shown by authenticator apps
+    MANIFEST_FORMAT_BASE32,
+    // Seeds of SEED_LEN bytes back to back, without any separators
+    MANIFEST_FORMAT_RAW,
+} ManifestFormat;
+
+/*
+ * Called for each seed in a manifest, in order. Seeds that aren't valid are passed as all zeroes, with status saying
+ * what's wrong with them.
+ * record is the line the seed is on for text formats and the number of the seed for the raw format, counting from 1.
+ */
+typedef void (*ManifestCallback)(const uint8_t seed[SEED_LEN], const SeedStatus status, const size_t record,
+                                 void *user_data);
+
+/*
+ * Incrementally parses a manifest fed to it in chunks of any size.
+ * In text formats, spaces, tabs and carriage returns are ignored, as are blank lines and lines starting with '#'.
+ * base32 seeds may be in either case and end in '=' padding.
+ */
+typedef struct {
+    ManifestFormat format;
+    ManifestCallback callback;
+    void *user_data;
+    // Characters of the seeds in the batch, back to back, SEED_LEN_ASCII or SEED_LEN_BASE32 apiece
+    char chars[MANIFEST_BATCH_SIZE * SEED_LEN_ASCII];
+    uint8_t seeds[MANIFEST_BATCH_SIZE * SEED_LEN];
+    SeedStatus status[MANIFEST_BATCH_SIZE];
+    // Problems found while reading the line, which the decoder can't see
+    SeedStatus line_status[MANIFEST_BATCH_SIZE];
+    size_t records[MANIFEST_BATCH_SIZE];
+    size_t batch_len;
+    // The line being read, which may be split across chunks
+    size_t line;
+    char line_chars[SEED_LEN_ASCII];
+    size_t line_len;
+    bool line_is_comment;
+    bool line_has_padding;
+    SeedStatus line_error;
+    // Start of a raw seed split across chunks
+    uint8_t partial[SEED_LEN];
+    size_t partial_len;
+    // Totals so far
+    size_t num_seeds;
+    size_t num_invalid;
+} ManifestParser;
+
+void manifest_parser_init(ManifestParser *parser, const ManifestFormat format, ManifestCallback callback,
+                          void *user_data);
+
+// Parse the next len bytes of the manifest. The callback has been called for every seed they complete on return.
+void manifest_parser_feed(ManifestParser *parser, const void *data, const size_t len);
+
+// Signal the end of the manifest, passing on the last seed if it's unterminated or truncated.
+void manifest_parser_finish(ManifestParser *parser);
+
+/*
+ * Parse a whole manifest from file, MANIFEST_READ_SIZE bytes at a time. Raw manifests must be opened in binary mode.
+ * The number of seeds found, and how many of them aren't valid, are stored in num_seeds and num_invalid if not NULL.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int manifest_parse_file(FILE *file, const ManifestFormat format, ManifestCallback callback, void *user_data,
+                        size_t *num_seeds, size_t *num_invalid);
+
+// Parse a format name ("hex", "base32" or "raw"). Returns 0 on success, -1 if the name is unknown.
+int manifest_format_from_string(const char *name, ManifestFormat *format);
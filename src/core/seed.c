@@ -0,0 +1,250 @@
+#include "seed.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SEED_HAVE_SSE2
+#endif
+
+// AVX2 is only compiled in where it can be enabled per function, and used if the CPU turns out to support it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(SEED_HAVE_SSE2)
+#include <immintrin.h>
+#define SEED_HAVE_AVX2
+#endif
+
+// Bits set for each character of a seed
+#define SEED_CHAR_MASK ((UINT64_C(1) << SEED_LEN_ASCII) - 1)
+
+/*
+ * None of the decoders branch on or index by the characters. Characters map to nibbles through arithmetic and masks,
+ * and whether they're valid is only looked at once per seed.
+ */
+
+// Decode a hex digit into *invalid, which gets bits set if it isn't one.
+static uint8_t seed_nibble(const uint8_t c, uint8_t *invalid) {
+    const uint8_t num = (uint8_t)(c - '0');
+    // Folds upper case onto lower case, and leaves digits alone
+    const uint8_t alpha = (uint8_t)((c | 0x20) - 'a');
+    // All ones if in range: The subtraction only borrows from the upper bits if it is
+    const uint8_t is_num = (uint8_t)(((unsigned int)num - 10) >> 8);
+    const uint8_t is_alpha = (uint8_t)(((unsigned int)alpha - 6) >> 8);
+    *invalid |= (uint8_t)~(is_num | is_alpha);
+    return (uint8_t)((is_num & num) | (is_alpha & (uint8_t)(alpha + 10)));
+}
+
+static SeedStatus seed_decode_scalar(const char *ascii, uint8_t *out) {
+    uint8_t invalid = 0;
+    for (size_t i = 0; i < SEED_LEN; i++) {
+        const uint8_t hi = seed_nibble((uint8_t)ascii[2 * i], &invalid);
+        const uint8_t lo = seed_nibble((uint8_t)ascii[2 * i + 1], &invalid);
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return invalid == 0 ? SEED_OK : SEED_ERR_NOT_HEX;
+}
+
+// Store the low 40 bits of a group of 8 base32 digits as 5 bytes, most significant first.
+static void seed_store_base32_group(const uint64_t group, uint8_t *out) {
+    for (size_t i = 0; i < 5; i++) {
+        out[i] = (uint8_t)(group >> (8 * (4 - i)));
+    }
+}
+
+#ifndef SEED_HAVE_SSE2
+// Decode a base32 digit the same way as seed_nibble().
+static uint8_t seed_base32_digit(const uint8_t c, uint8_t *invalid) {
+    const uint8_t alpha = (uint8_t)((c | 0x20) - 'a');
+    const uint8_t num = (uint8_t)(c - '2');
+    const uint8_t is_alpha = (uint8_t)(((unsigned int)alpha - 26) >> 8);
+    const uint8_t is_num = (uint8_t)(((unsigned int)num - 6) >> 8);
+    *invalid |= (uint8_t)~(is_alpha | is_num);
+    return (uint8_t)((is_alpha & alpha) | (is_num & (uint8_t)(num + 26)));
+}
+
+static SeedStatus seed_decode_base32_scalar(const char *ascii, uint8_t *out) {
+    uint8_t invalid = 0;
+    for (size_t i = 0; i < SEED_LEN_BASE32 / 8; i++) {
+        uint64_t group = 0;
+        for (size_t j = 0; j < 8; j++) {
+            group = group << 5 | seed_base32_digit((uint8_t)ascii[8 * i + j], &invalid);
+        }
+        seed_store_base32_group(group, out + 5 * i);
+    }
+    return invalid == 0 ? SEED_OK : SEED_ERR_NOT_BASE32;
+}
+#endif
+
+#ifdef SEED_HAVE_SSE2
+// The characters of seed index in a block, given a bitmap of invalid characters with two spare words at the end.
+static uint64_t seed_block_bits(const uint32_t *bitmap, const size_t index) {
+    const size_t start = index * SEED_LEN_ASCII;
+    const size_t word = start / 32;
+    const size_t shift = start % 32;
+    uint64_t bits = ((uint64_t)bitmap[word] | (uint64_t)bitmap[word + 1] << 32) >> shift;
+    if (shift > 64 - SEED_LEN_ASCII) {
+        bits |= (uint64_t)bitmap[word + 2] << (64 - shift);
+    }
+    return bits & SEED_CHAR_MASK;
+}
+
+// Decode 16 characters into 8 bytes, one in the low half of each 16-bit lane. valid gets all ones for hex digits.
+static __m128i seed_hex_sse2(const __m128i c, __m128i *valid) {
+    const __m128i num = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    const __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    // There's no unsigned comparison, but x <= max exactly if min(x, max) == x
+    const __m128i is_num = _mm_cmpeq_epi8(_mm_min_epu8(num, _mm_set1_epi8(9)), num);
+    const __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    *valid = _mm_or_si128(is_num, is_alpha);
+    const __m128i nibbles = _mm_or_si128(_mm_and_si128(is_num, num),
+                                         _mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+    // Characters at even positions are the high nibbles
+    const __m128i hi = _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00ff)), 4);
+    return _mm_or_si128(hi, _mm_srli_epi16(nibbles, 8));
+}
+
+// Decode 2 seeds (80 characters, 5 vectors) at once.
+static void seed_decode2_sse2(const char *ascii, uint8_t *out, SeedStatus status[2]) {
+    __m128i bytes[5];
+    uint32_t invalid[3 + 2] = {0};
+    for (size_t i = 0; i < 5; i++) {
+        __m128i valid;
+        bytes[i] = seed_hex_sse2(_mm_loadu_si128((const __m128i *)(ascii + 16 * i)), &valid);
+        invalid[i / 2] |= (uint32_t)(~_mm_movemask_epi8(valid) & 0xffff) << (16 * (i % 2));
+    }
+    _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(bytes[0], bytes[1]));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_packus_epi16(bytes[2], bytes[3]));
+    _mm_storel_epi64((__m128i *)(out + 32), _mm_packus_epi16(bytes[4], _mm_setzero_si128()));
+    for (size_t i = 0; i < 2; i++) {
+        status[i] = seed_block_bits(invalid, i) == 0 ? SEED_OK : SEED_ERR_NOT_HEX;
+    }
+}
+
+// Decode a base32 seed (32 characters, 2 vectors). Each vector packs into 2 groups of 40 bits.
+static SeedStatus seed_decode_base32_sse2(const char *ascii, uint8_t *out) {
+    uint32_t invalid = 0;
+    for (size_t i = 0; i < 2; i++) {
+        const __m128i c = _mm_loadu_si128((const __m128i *)(ascii + 16 * i));
+        const __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+        const __m128i num = _mm_sub_epi8(c, _mm_set1_epi8('2'));
+        const __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(25)), alpha);
+        const __m128i is_num = _mm_cmpeq_epi8(_mm_min_epu8(num, _mm_set1_epi8(5)), num);
+        invalid |= (uint32_t)(~_mm_movemask_epi8(_mm_or_si128(is_alpha, is_num)) & 0xffff);
+        const __m128i digits = _mm_or_si128(_mm_and_si128(is_alpha, alpha),
+                                            _mm_and_si128(is_num, _mm_add_epi8(num, _mm_set1_epi8(26))));
+        // 2 digits into 10 bits per 16-bit lane, then 4 digits into 20 bits per 32-bit lane, then 8 into 40 bits
+        const __m128i pairs = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(digits, _mm_set1_epi16(0x00ff)), 5),
+                                           _mm_srli_epi16(digits, 8));
+        const __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00010400));
+        const __m128i groups = _mm_or_si128(_mm_slli_epi64(_mm_and_si128(quads, _mm_set_epi32(0, -1, 0, -1)), 20),
+                                            _mm_srli_epi64(quads, 32));
+        uint64_t group[2];
+        _mm_storeu_si128((__m128i *)group, groups);
+        seed_store_base32_group(group[0], out + 10 * i);
+        seed_store_base32_group(group[1], out + 10 * i + 5);
+    }
+    return invalid == 0 ? SEED_OK : SEED_ERR_NOT_BASE32;
+}
+#endif
+
+#ifdef SEED_HAVE_AVX2
+// Same as seed_hex_sse2(), for 32 characters.
+__attribute__((target("avx2"))) static __m256i seed_hex_avx2(const __m256i c, __m256i *valid) {
+    const __m256i num = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    const __m256i alpha = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    const __m256i is_num = _mm256_cmpeq_epi8(_mm256_min_epu8(num, _mm256_set1_epi8(9)), num);
+    const __m256i is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+    *valid = _mm256_or_si256(is_num, is_alpha);
+    const __m256i nibbles = _mm256_or_si256(_mm256_and_si256(is_num, num),
+                                            _mm256_and_si256(is_alpha, _mm256_add_epi8(alpha, _mm256_set1_epi8(10))));
+    const __m256i hi = _mm256_slli_epi16(_mm256_and_si256(nibbles, _mm256_set1_epi16(0x00ff)), 4);
+    return _mm256_or_si256(hi, _mm256_srli_epi16(nibbles, 8));
+}
+
+// Pack two vectors of decoded bytes. Packing works per 128-bit lane, so the 64-bit quarters have to be put in order.
+__attribute__((target("avx2"))) static __m256i seed_pack_avx2(const __m256i a, const __m256i b) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+// Decode 4 seeds (160 characters, 5 vectors) at once.
+__attribute__((target("avx2"))) static void seed_decode4_avx2(const char *ascii, uint8_t *out, SeedStatus status[4]) {
+    __m256i bytes[5];
+    uint32_t invalid[5 + 2] = {0};
+    for (size_t i = 0; i < 5; i++) {
+        __m256i valid;
+        bytes[i] = seed_hex_avx2(_mm256_loadu_si256((const __m256i *)(ascii + 32 * i)), &valid);
+        invalid[i] = ~(uint32_t)_mm256_movemask_epi8(valid);
+    }
+    _mm256_storeu_si256((__m256i *)out, seed_pack_avx2(bytes[0], bytes[1]));
+    _mm256_storeu_si256((__m256i *)(out + 32), seed_pack_avx2(bytes[2], bytes[3]));
+    _mm_storeu_si128((__m128i *)(out + 64),
+                     _mm256_castsi256_si128(seed_pack_avx2(bytes[4], _mm256_setzero_si256())));
+    for (size_t i = 0; i < 4; i++) {
+        status[i] = seed_block_bits(invalid, i) == 0 ? SEED_OK : SEED_ERR_NOT_HEX;
+    }
+}
+#endif
+
+// Zero the output of seeds that aren't valid, returning how many there are.
+static size_t seed_zero_invalid(const size_t count, uint8_t *out, const SeedStatus *status) {
+    size_t num_invalid = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (status[i] != SEED_OK) {
+            memset(out + i * SEED_LEN, 0, SEED_LEN);  // NOLINT (GCC doesn't support _s)
+            num_invalid++;
+        }
+    }
+    return num_invalid;
+}
+
+size_t seed_decode_bulk(const char *ascii, const size_t count, uint8_t *out, SeedStatus *status) {
+    size_t i = 0;
+#ifdef SEED_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        for (; i + 4 <= count; i += 4) {
+            seed_decode4_avx2(ascii + i * SEED_LEN_ASCII, out + i * SEED_LEN, status + i);
+        }
+    }
+#endif
+#ifdef SEED_HAVE_SSE2
+    for (; i + 2 <= count; i += 2) {
+        seed_decode2_sse2(ascii + i * SEED_LEN_ASCII, out + i * SEED_LEN, status + i);
+    }
+#endif
+    for (; i < count; i++) {
+        status[i] = seed_decode_scalar(ascii + i * SEED_LEN_ASCII, out + i * SEED_LEN);
+    }
+    return seed_zero_invalid(count, out, status);
+}
+
+int seed_decode(const char ascii[SEED_LEN_ASCII], uint8_t out[SEED_LEN]) {
+    SeedStatus status = SEED_OK;
+    return seed_decode_bulk(ascii, 1, out, &status) == 0 ? 0 : -1;
+}
+
+size_t seed_decode_base32_bulk(const char *ascii, const size_t count, uint8_t *out, SeedStatus *status) {
+    for (size_t i = 0; i < count; i++) {
+#ifdef SEED_HAVE_SSE2
+        status[i] = seed_decode_base32_sse2(ascii + i * SEED_LEN_BASE32, out + i * SEED_LEN);
+#else
+        status[i] = seed_decode_base32_scalar(ascii + i * SEED_LEN_BASE32, out + i * SEED_LEN);
+#endif
+    }
+    return seed_zero_invalid(count, out, status);
+}
+
+const char *seed_status_string(const SeedStatus status) {
+    switch (status) {
+        case SEED_OK:
+            return "Valid";
+        case SEED_ERR_NOT_HEX:
+            return "Seed contains non-hex characters";
+        case SEED_ERR_NOT_BASE32:
+            return "Seed contains non-base32 characters";
+        case SEED_ERR_LENGTH:
+            return "Seed has the wrong length";
+        default:
+            return "Unknown seed status";
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// HOTP seeds are given as this many hexadecimal characters, encoding half as many bytes
+#define SEED_LEN_ASCII  40
+#define SEED_LEN        20
+// Or as this many RFC 4648 base32 characters, without padding
+#define SEED_LEN_BASE32 32
+
+typedef enum {
+    SEED_OK,
+    // A character isn't a hexadecimal digit
+    SEED_ERR_NOT_HEX,
+    // A character isn't in the base32 alphabet
+    SEED_ERR_NOT_BASE32,
+    // The seed is too short or too long
+    SEED_ERR_LENGTH,
+} SeedStatus;
+
+/*
+ * Validates and decodes count seeds, stored back to back in ascii (count * SEED_LEN_ASCII characters, without any
+ * separators or terminators), into count * SEED_LEN bytes in out.
+ * The outcome for each seed is stored in status. Seeds that aren't valid decode to all zeroes.
+ * Uses AVX2 or SSE2 where the CPU supports it. The time taken doesn't depend on the characters, so seeds can't be
+ * recovered from it.
+ * Returns the number of seeds that aren't valid.
+ */
+size_t seed_decode_bulk(const char *ascii, const size_t count, uint8_t *out, SeedStatus *status);
+
+/*
+ * Same for a single seed.
+ * Returns 0 on success, -1 if the seed isn't valid.
+ */
+int seed_decode(const char ascii[SEED_LEN_ASCII], uint8_t out[SEED_LEN]);
+
+/*
+ * Same as seed_decode_bulk(), for seeds given as count * SEED_LEN_BASE32 base32 characters. Both upper and lower case
+ * letters are accepted.
+ * Returns the number of seeds that aren't valid.
+ */
+size_t seed_decode_base32_bulk(const char *ascii, const size_t count, uint8_t *out, SeedStatus *status);
+
+// Describe a seed status.
+const char *seed_status_string(const SeedStatus status);
@@ -0,0 +1,272 @@
+#include "sha1.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static uint32_t sha1_rotl(const uint32_t x, const unsigned int n) { return (x << n) | (x >> (32 - n)); }
+
+static uint32_t sha1_load_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static void sha1_store_be32(uint8_t *p, const uint32_t x) {
+    p[0] = (uint8_t)(x >> 24);
+    p[1] = (uint8_t)(x >> 16);
+    p[2] = (uint8_t)(x >> 8);
+    p[3] = (uint8_t)x;
+}
+
+// Process a single block. The message schedule is kept as a rolling window of 16 words.
+static void sha1_compress(uint32_t state[5], const uint8_t block[SHA1_BLOCK_LEN]) {
+    uint32_t w[16];
+    for (size_t i = 0; i < 16; i++) {
+        w[i] = sha1_load_be32(block + 4 * i);
+    }
+
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+    for (size_t i = 0; i < 80; i++) {
+        if (i >= 16) {
+            w[i % 16] = sha1_rotl(w[(i - 3) % 16] ^ w[(i - 8) % 16] ^ w[(i - 14) % 16] ^ w[i % 16], 1);
+        }
+        uint32_t f = 0;
+        uint32_t k = 0;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        const uint32_t t = sha1_rotl(a, 5) + f + e + k + w[i % 16];
+        e = d;
+        d = c;
+        c = sha1_rotl(b, 30);
+        b = a;
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+#ifdef __GNUC__
+// Lanes as vectors of 4 and of all of them. The compiler splits vectors into as many registers as the target needs.
+typedef uint32_t SHA1Vec4 __attribute__((vector_size(16)));
+typedef uint32_t SHA1Vec16 __attribute__((vector_size(4 * SHA1_LANES)));
+
+// Macros rather than functions, as passing vectors wider than the target's registers around changes the ABI
+#define SHA1_ROTL_VEC(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define SHA1_ROUND_VEC(Vec, i, f, k)                                                       \
+    do {                                                                                   \
+        if ((i) >= 16) {                                                                   \
+            const Vec x = w[((i)-3) % 16] ^ w[((i)-8) % 16] ^ w[((i)-14) % 16] ^ w[(i) % 16]; \
+            w[(i) % 16] = SHA1_ROTL_VEC(x, 1);                                             \
+        }                                                                                  \
+        const Vec t = SHA1_ROTL_VEC(a, 5) + (f) + e + (uint32_t)(k) + w[(i) % 16];         \
+        e = d;                                                                             \
+        d = c;                                                                             \
+        c = SHA1_ROTL_VEC(b, 30);                                                          \
+        b = a;                                                                             \
+        a = t;                                                                             \
+    } while (0)
+
+/*
+ * Define name() doing the same as sha1_compress() for the lanes starting at lane, one per element of Vec. It's inlined
+ * into a copy per instruction set.
+ * The rounds are split into their 4 kinds and unrolled, so that the loops don't branch and the schedule can be kept in
+ * registers rather than indexed in memory.
+ */
+#define SHA1_DEFINE_COMPRESS_VEC(name, Vec)                                                                   \
+    static inline __attribute__((always_inline)) void name(uint32_t state[5][SHA1_LANES],                     \
+                                                           const uint32_t block[16][SHA1_LANES], const size_t lane) { \
+        Vec w[16];                                                                                            \
+        Vec s[5];                                                                                             \
+        for (size_t i = 0; i < 16; i++) {                                                                     \
+            memcpy(&w[i], &block[i][lane], sizeof(Vec)); /* NOLINT (GCC doesn't support _s) */                \
+        }                                                                                                     \
+        for (size_t i = 0; i < 5; i++) {                                                                      \
+            memcpy(&s[i], &state[i][lane], sizeof(Vec)); /* NOLINT (GCC doesn't support _s) */                \
+        }                                                                                                     \
+        Vec a = s[0];                                                                                         \
+        Vec b = s[1];                                                                                         \
+        Vec c = s[2];                                                                                         \
+        Vec d = s[3];                                                                                         \
+        Vec e = s[4];                                                                                         \
+        _Pragma("GCC unroll 20") for (size_t i = 0; i < 20; i++) {                                            \
+            SHA1_ROUND_VEC(Vec, i, (b & c) | (~b & d), 0x5a827999);                                           \
+        }                                                                                                     \
+        _Pragma("GCC unroll 20") for (size_t i = 20; i < 40; i++) {                                           \
+            SHA1_ROUND_VEC(Vec, i, b ^ c ^ d, 0x6ed9eba1);                                                    \
+        }                                                                                                     \
+        _Pragma("GCC unroll 20") for (size_t i = 40; i < 60; i++) {                                           \
+            SHA1_ROUND_VEC(Vec, i, (b & c) | (b & d) | (c & d), 0x8f1bbcdc);                                  \
+        }                                                                                                     \
+        _Pragma("GCC unroll 20") for (size_t i = 60; i < 80; i++) {                                           \
+            SHA1_ROUND_VEC(Vec, i, b ^ c ^ d, 0xca62c1d6);                                                    \
+        }                                                                                                     \
+        s[0] += a;                                                                                            \
+        s[1] += b;                                                                                            \
+        s[2] += c;                                                                                            \
+        s[3] += d;                                                                                            \
+        s[4] += e;                                                                                            \
+        for (size_t i = 0; i < 5; i++) {                                                                      \
+            memcpy(&state[i][lane], &s[i], sizeof(Vec)); /* NOLINT (GCC doesn't support _s) */                \
+        }                                                                                                     \
+    }
+
+SHA1_DEFINE_COMPRESS_VEC(sha1_compress_vec4, SHA1Vec4)
+SHA1_DEFINE_COMPRESS_VEC(sha1_compress_vec16, SHA1Vec16)
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA1_HAVE_X86_MULTI
+
+__attribute__((target("avx512f"))) static void sha1_compress_multi_avx512(uint32_t state[5][SHA1_LANES],
+                                                                         const uint32_t block[16][SHA1_LANES]) {
+    sha1_compress_vec16(state, block, 0);
+}
+
+__attribute__((target("avx2"))) static void sha1_compress_multi_avx2(uint32_t state[5][SHA1_LANES],
+                                                                    const uint32_t block[16][SHA1_LANES]) {
+    sha1_compress_vec16(state, block, 0);
+}
+#endif
+
+void sha1_compress_multi(uint32_t state[5][SHA1_LANES], const uint32_t block[16][SHA1_LANES]) {
+#ifdef SHA1_HAVE_X86_MULTI
+    if (__builtin_cpu_supports("avx512f")) {
+        sha1_compress_multi_avx512(state, block);
+        return;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sha1_compress_multi_avx2(state, block);
+        return;
+    }
+#endif
+#ifdef __GNUC__
+    // 4 lanes at a time, which SSE2 has enough registers for, and whatever the target offers elsewhere
+    for (size_t lane = 0; lane < SHA1_LANES; lane += 4) {
+        sha1_compress_vec4(state, block, lane);
+    }
+#else
+    for (size_t lane = 0; lane < SHA1_LANES; lane++) {
+        uint32_t lane_state[5];
+        uint8_t lane_block[SHA1_BLOCK_LEN];
+        for (size_t i = 0; i < 5; i++) {
+            lane_state[i] = state[i][lane];
+        }
+        for (size_t i = 0; i < 16; i++) {
+            sha1_store_be32(lane_block + 4 * i, block[i][lane]);
+        }
+        sha1_compress(lane_state, lane_block);
+        for (size_t i = 0; i < 5; i++) {
+            state[i][lane] = lane_state[i];
+        }
+    }
+#endif
+}
+
+void sha1_init(SHA1Context *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->len = 0;
+    ctx->block_len = 0;
+}
+
+void sha1_update(SHA1Context *ctx, const void *data, const size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t left = len;
+    ctx->len += len;
+    // Complete a block started by a previous call first
+    if (ctx->block_len > 0) {
+        const size_t n = left < SHA1_BLOCK_LEN - ctx->block_len ? left : SHA1_BLOCK_LEN - ctx->block_len;
+        memcpy(ctx->block + ctx->block_len, p, n);  // NOLINT (GCC doesn't support _s)
+        ctx->block_len += n;
+        p += n;
+        left -= n;
+        if (ctx->block_len < SHA1_BLOCK_LEN) {
+            return;
+        }
+        sha1_compress(ctx->state, ctx->block);
+        ctx->block_len = 0;
+    }
+    for (; left >= SHA1_BLOCK_LEN; p += SHA1_BLOCK_LEN, left -= SHA1_BLOCK_LEN) {
+        sha1_compress(ctx->state, p);
+    }
+    memcpy(ctx->block, p, left);  // NOLINT (GCC doesn't support _s)
+    ctx->block_len = left;
+}
+
+void sha1_final(SHA1Context *ctx, uint8_t digest[SHA1_DIGEST_LEN]) {
+    const uint64_t bit_len = ctx->len * 8;
+    // Pad with a single set bit and zeroes up to the length, which takes up the last 8 bytes of a block
+    ctx->block[ctx->block_len++] = 0x80;
+    if (ctx->block_len > SHA1_BLOCK_LEN - 8) {
+        memset(ctx->block + ctx->block_len, 0, SHA1_BLOCK_LEN - ctx->block_len);  // NOLINT (GCC doesn't support _s)
+        sha1_compress(ctx->state, ctx->block);
+        ctx->block_len = 0;
+    }
+    memset(ctx->block + ctx->block_len, 0, SHA1_BLOCK_LEN - 8 - ctx->block_len);  // NOLINT (GCC doesn't support _s)
+    sha1_store_be32(ctx->block + SHA1_BLOCK_LEN - 8, (uint32_t)(bit_len >> 32));
+    sha1_store_be32(ctx->block + SHA1_BLOCK_LEN - 4, (uint32_t)bit_len);
+    sha1_compress(ctx->state, ctx->block);
+
+    for (size_t i = 0; i < 5; i++) {
+        sha1_store_be32(digest + 4 * i, ctx->state[i]);
+    }
+}
+
+void sha1(const void *data, const size_t len, uint8_t digest[SHA1_DIGEST_LEN]) {
+    SHA1Context ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, data, len);
+    sha1_final(&ctx, digest);
+}
+
+void hmac_sha1(const uint8_t *key, const size_t key_len, const void *msg, const size_t msg_len,
+               uint8_t mac[SHA1_DIGEST_LEN]) {
+    // Keys longer than a block are hashed down first
+    uint8_t block_key[SHA1_BLOCK_LEN] = {0};
+    if (key_len > SHA1_BLOCK_LEN) {
+        sha1(key, key_len, block_key);
+    } else {
+        memcpy(block_key, key, key_len);  // NOLINT (GCC doesn't support _s)
+    }
+
+    uint8_t pad[SHA1_BLOCK_LEN];
+    for (size_t i = 0; i < SHA1_BLOCK_LEN; i++) {
+        pad[i] = block_key[i] ^ 0x36;
+    }
+    uint8_t inner[SHA1_DIGEST_LEN];
+    SHA1Context ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, pad, sizeof(pad));
+    sha1_update(&ctx, msg, msg_len);
+    sha1_final(&ctx, inner);
+
+    for (size_t i = 0; i < SHA1_BLOCK_LEN; i++) {
+        pad[i] = block_key[i] ^ 0x5c;
+    }
+    sha1_init(&ctx);
+    sha1_update(&ctx, pad, sizeof(pad));
+    sha1_update(&ctx, inner, sizeof(inner));
+    sha1_final(&ctx, mac);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sizes of a SHA-1 digest, and of the blocks the message is processed in
+#define SHA1_DIGEST_LEN 20
+#define SHA1_BLOCK_LEN  64
+
+// Independent hashes sha1_compress_multi() works on at once
+#define SHA1_LANES 16
+
+// Incremental SHA-1 (FIPS 180-4) computation.
+typedef struct {
+    uint32_t state[5];
+    // Total message length so far, in bytes
+    uint64_t len;
+    // Start of a block that isn't complete yet
+    uint8_t block[SHA1_BLOCK_LEN];
+    size_t block_len;
+} SHA1Context;
+
+void sha1_init(SHA1Context *ctx);
+
+void sha1_update(SHA1Context *ctx, const void *data, const size_t len);
+
+// Finish the computation, storing the digest. ctx has to be initialized again to be reused.
+void sha1_final(SHA1Context *ctx, uint8_t digest[SHA1_DIGEST_LEN]);
+
+// Hash a whole message at once.
+void sha1(const void *data, const size_t len, uint8_t digest[SHA1_DIGEST_LEN]);
+
+// HMAC (RFC 2104) using SHA-1, with a key of any length.
+void hmac_sha1(const uint8_t *key, const size_t key_len, const void *msg, const size_t msg_len,
+               uint8_t mac[SHA1_DIGEST_LEN]);
+
+/*
+ * Process one block for each of SHA1_LANES independent hashes, in parallel. Both are stored lane by lane:
+ * state[i][lane] is word i of a lane's state and block[i][lane] is word i of its block, already read as big endian.
+ * Uses AVX-512 (16 lanes per instruction), AVX2 (8) or SSE2 (4), whichever the CPU supports.
+ */
+void sha1_compress_multi(uint32_t state[5][SHA1_LANES], const uint32_t block[16][SHA1_LANES]);
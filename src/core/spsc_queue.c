@@ -0,0 +1,39 @@
+#include "spsc_queue.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+_Static_assert((SPSC_QUEUE_CAPACITY & (SPSC_QUEUE_CAPACITY - 1)) == 0, "Queue capacity must be a power of two");
+
+void spsc_queue_init(SPSCQueue *queue) {
+    for (size_t i = 0; i < SPSC_QUEUE_CAPACITY; i++) {
+        queue->slots[i] = NULL;
+    }
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+bool spsc_queue_push(SPSCQueue *queue, void *item) {
+    const size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head == SPSC_QUEUE_CAPACITY) {
+        return false;
+    }
+    queue->slots[tail & (SPSC_QUEUE_CAPACITY - 1)] = item;
+    // Publish the slot (and whatever the item points to) to the consumer
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void *spsc_queue_pop(SPSCQueue *queue) {
+    const size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    const size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    void *item = queue->slots[head & (SPSC_QUEUE_CAPACITY - 1)];
+    // Hand the slot back to the producer
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
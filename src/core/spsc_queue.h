@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Number of slots in a queue, must be a power of two
+#define SPSC_QUEUE_CAPACITY 16
+
+// Cache line size, the indices are kept apart so that producer and consumer don't keep stealing each other's line
+#define SPSC_CACHE_LINE 64
+
+// Bounded lock-free FIFO of pointers between exactly one producer thread and exactly one consumer thread.
+typedef struct {
+    void *slots[SPSC_QUEUE_CAPACITY];
+    // Next slot to pop, only written by the consumer
+    alignas(SPSC_CACHE_LINE) atomic_size_t head;
+    // Next slot to push, only written by the producer
+    alignas(SPSC_CACHE_LINE) atomic_size_t tail;
+} SPSCQueue;
+
+void spsc_queue_init(SPSCQueue *queue);
+
+// Returns false if the queue is full. Must only be called by the producer.
+bool spsc_queue_push(SPSCQueue *queue, void *item);
+
+// Returns NULL if the queue is empty. Must only be called by the consumer.
+void *spsc_queue_pop(SPSCQueue *queue);
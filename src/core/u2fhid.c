@@ -3,90 +3,645 @@
 #include <libusb.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+// windows.h has to come first
+#include <bcrypt.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <sys/random.h>
+#endif
+
+#include "deadline.h"
 #include "log.h"
 #include "usb.h"
+#include "usb_async.h"
 
 static const FIDOCID U2FHID_BROADCAST_CID = {0xff, 0xff, 0xff, 0xff};
 
-int fido_send_packet(libusb_device_handle *handle, const FIDOInitPacket packet) {
-    uint8_t buf[FIDO_PACKET_SIZE];
-    memset(buf, 0, FIDO_PACKET_SIZE * sizeof(uint8_t));  // NOLINT (GCC doesn't support _s)
+_Static_assert(FIDO_PACKET_SIZE == USB_FRAME_SIZE, "Pooled frames must be able to hold a U2FHID packet");
+
+bool fido_packet_is_init(const uint8_t packet[FIDO_PACKET_SIZE]) {
+    return (packet[FIDO_PACKET_CMD_OFFSET] & U2FHID_TYPE_INIT) != 0;
+}
+
+const uint8_t *fido_packet_cid(const uint8_t packet[FIDO_PACKET_SIZE]) { return packet + FIDO_PACKET_CID_OFFSET; }
+
+uint8_t fido_packet_cmd(const uint8_t packet[FIDO_PACKET_SIZE]) { return packet[FIDO_PACKET_CMD_OFFSET]; }
+
+uint8_t fido_packet_seq(const uint8_t packet[FIDO_PACKET_SIZE]) { return packet[FIDO_PACKET_SEQ_OFFSET]; }
+
+uint16_t fido_packet_bcnt(const uint8_t packet[FIDO_PACKET_SIZE]) {
+    return (uint16_t)((packet[FIDO_PACKET_BCNTH_OFFSET] << 8) | packet[FIDO_PACKET_BCNTL_OFFSET]);
+}
+
+const uint8_t *fido_packet_data(const uint8_t packet[FIDO_PACKET_SIZE]) {
+    if (fido_packet_is_init(packet)) {
+        return packet + FIDO_PACKET_DATA_OFFSET;
+    }
+    return packet + FIDO_PACKET_CONT_DATA_OFFSET;
+}
+
+uint8_t *fido_packet_init(uint8_t packet[FIDO_PACKET_SIZE], const FIDOCID cid, const uint8_t cmd,
+                          const uint16_t bcnt) {
+    memset(packet, 0, FIDO_PACKET_SIZE * sizeof(uint8_t));       // NOLINT (GCC doesn't support _s)
+    memcpy(packet + FIDO_PACKET_CID_OFFSET, cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+    packet[FIDO_PACKET_CMD_OFFSET] = cmd;
+    packet[FIDO_PACKET_BCNTH_OFFSET] = (uint8_t)(bcnt >> 8);
+    packet[FIDO_PACKET_BCNTL_OFFSET] = (uint8_t)(bcnt & 0xff);
+    return packet + FIDO_PACKET_DATA_OFFSET;
+}
+
+size_t fido_packet_count(const uint16_t data_len) {
+    if (data_len <= FIDO_PACKET_DATA_LEN) {
+        return 1;
+    }
+    return 1 + (data_len - FIDO_PACKET_DATA_LEN + FIDO_CONT_DATA_LEN - 1) / FIDO_CONT_DATA_LEN;
+}
+
+void fido_build_packet(const FIDOCID cid, const uint8_t cmd, const uint8_t *data, const uint16_t data_len,
+                       const size_t index, uint8_t packet[FIDO_PACKET_SIZE]) {
+    if (index == 0) {
+        uint8_t *payload = fido_packet_init(packet, cid, cmd, data_len);
+        const size_t chunk = data_len < FIDO_PACKET_DATA_LEN ? data_len : FIDO_PACKET_DATA_LEN;
+        // Commands without payload may pass NULL
+        if (chunk > 0) {
+            memcpy(payload, data, chunk);  // NOLINT (GCC doesn't support _s)
+        }
+        return;
+    }
+    memset(packet, 0, FIDO_PACKET_SIZE * sizeof(uint8_t));       // NOLINT (GCC doesn't support _s)
+    memcpy(packet + FIDO_PACKET_CID_OFFSET, cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+    packet[FIDO_PACKET_SEQ_OFFSET] = (uint8_t)(index - 1);
+    const size_t offset = FIDO_PACKET_DATA_LEN + (index - 1) * FIDO_CONT_DATA_LEN;
+    const size_t remaining = data_len - offset;
+    const size_t chunk = remaining < FIDO_CONT_DATA_LEN ? remaining : FIDO_CONT_DATA_LEN;
+    memcpy(packet + FIDO_PACKET_CONT_DATA_OFFSET, data + offset, chunk);  // NOLINT (GCC doesn't support _s)
+}
+
+void fido_reassembly_init(FIDOReassembly *reassembly, uint8_t *buf, const size_t buf_len) {
+    memset(reassembly, 0, sizeof(FIDOReassembly));  // NOLINT (GCC doesn't support _s)
+    reassembly->buf = buf;
+    reassembly->buf_len = buf_len;
+}
+
+int fido_reassembly_feed(FIDOReassembly *reassembly, const uint8_t packet[FIDO_PACKET_SIZE]) {
+    size_t chunk = 0;
+    if (fido_packet_is_init(packet)) {
+        if (reassembly->started) {
+            log_error("Failed to receive U2FHID message: Unexpected initialization packet");
+            return -1;
+        }
+        const uint16_t len = fido_packet_bcnt(packet);
+        if (len > reassembly->buf_len || len > FIDO_MAX_MESSAGE_LEN) {
+            log_error("Failed to receive U2FHID message: Message too long");
+            return -1;
+        }
+        memcpy(reassembly->cid, fido_packet_cid(packet), FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+        reassembly->cmd = fido_packet_cmd(packet);
+        reassembly->len = len;
+        reassembly->started = true;
+        chunk = len < FIDO_PACKET_DATA_LEN ? len : FIDO_PACKET_DATA_LEN;
+    } else {
+        if (!reassembly->started) {
+            log_error("Failed to receive U2FHID message: Continuation packet without initialization packet");
+            return -1;
+        }
+        if (memcmp(fido_packet_cid(packet), reassembly->cid, FIDO_CID_LEN) != 0) {
+            log_error("Failed to receive U2FHID message: Continuation packet on another channel");
+            return -1;
+        }
+        if (fido_packet_seq(packet) != reassembly->next_seq) {
+            log_error("Failed to receive U2FHID message: Continuation packet out of sequence");
+            return -1;
+        }
+        reassembly->next_seq++;
+        const size_t remaining = reassembly->len - reassembly->received;
+        chunk = remaining < FIDO_CONT_DATA_LEN ? remaining : FIDO_CONT_DATA_LEN;
+    }
+    memcpy(reassembly->buf + reassembly->received, fido_packet_data(packet), chunk);  // NOLINT (GCC doesn't support _s)
+    reassembly->received += (uint16_t)chunk;
+    return reassembly->received == reassembly->len ? 1 : 0;
+}
+
+bool fido_message_is_error(const FIDOReassembly *message) { return message->cmd == U2FHID_ERROR; }
+
+FIDOError fido_message_error(const FIDOReassembly *message) {
+    if (!fido_message_is_error(message)) {
+        return FIDO_ERROR_NONE;
+    }
+    if (message->len < 1) {
+        return FIDO_ERROR_PROTOCOL;
+    }
+    switch (message->buf[0]) {
+        case U2FHID_ERR_INVALID_CMD:
+            return FIDO_ERROR_INVALID_CMD;
+        case U2FHID_ERR_INVALID_PAR:
+            return FIDO_ERROR_INVALID_PAR;
+        case U2FHID_ERR_INVALID_LEN:
+            return FIDO_ERROR_INVALID_LEN;
+        case U2FHID_ERR_INVALID_SEQ:
+            return FIDO_ERROR_INVALID_SEQ;
+        case U2FHID_ERR_MSG_TIMEOUT:
+            return FIDO_ERROR_MSG_TIMEOUT;
+        case U2FHID_ERR_CHANNEL_BUSY:
+            return FIDO_ERROR_CHANNEL_BUSY;
+        case U2FHID_ERR_LOCK_REQUIRED:
+            return FIDO_ERROR_LOCK_REQUIRED;
+        case U2FHID_ERR_SYNC_FAIL:
+            return FIDO_ERROR_SYNC_FAIL;
+        default:
+            return FIDO_ERROR_OTHER;
+    }
+}
+
+FIDOError fido_status_word_error(const uint16_t status_word) {
+    // The whole class is treated alike, as the HyperFIDO doesn't use the second byte consistently
+    switch (status_word >> 8) {
+        case 0x90:
+            return FIDO_ERROR_NONE;
+        case 0x69:
+            return FIDO_ERROR_NOT_ALLOWED;
+        default:
+            break;
+    }
+    switch (status_word) {
+        case 0x6700:
+            return FIDO_ERROR_WRONG_LENGTH;
+        case 0x6a80:
+            return FIDO_ERROR_WRONG_DATA;
+        case 0x6d00:
+            return FIDO_ERROR_INS_NOT_SUPPORTED;
+        case 0x6e00:
+            return FIDO_ERROR_CLA_NOT_SUPPORTED;
+        default:
+            return FIDO_ERROR_APDU_OTHER;
+    }
+}
 
-    memcpy(buf + 0, packet.cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
-    buf[4] = packet.cmd;
-    buf[5] = packet.bcnth;
-    buf[6] = packet.bcntl;
-    memcpy(buf + 7, packet.data, FIDO_PACKET_DATA_LEN);  // NOLINT (GCC doesn't support _s)
+bool fido_error_is_retryable(const FIDOError error) {
+    switch (error) {
+        case FIDO_ERROR_TIMEOUT:
+        case FIDO_ERROR_IO:
+        case FIDO_ERROR_MSG_TIMEOUT:
+        case FIDO_ERROR_CHANNEL_BUSY:
+        case FIDO_ERROR_LOCK_REQUIRED:
+        case FIDO_ERROR_SYNC_FAIL:
+        case FIDO_ERROR_NOT_ALLOWED:
+            return true;
+        default:
+            return false;
+    }
+}
 
-    return usb_send(handle, buf, FIDO_PACKET_SIZE);
+const char *fido_error_string(const FIDOError error) {
+    switch (error) {
+        case FIDO_ERROR_NONE:
+            return "Success";
+        case FIDO_ERROR_TIMEOUT:
+            return "Operation timed out";
+        case FIDO_ERROR_CANCELLED:
+            return "Operation was cancelled";
+        case FIDO_ERROR_NO_DEVICE:
+            return "Device is gone";
+        case FIDO_ERROR_IO:
+            return "I/O error";
+        case FIDO_ERROR_PROTOCOL:
+            return "Malformed response";
+        case FIDO_ERROR_INVALID_CMD:
+            return "Device doesn't know the command";
+        case FIDO_ERROR_INVALID_PAR:
+            return "Invalid parameter";
+        case FIDO_ERROR_INVALID_LEN:
+            return "Invalid message length";
+        case FIDO_ERROR_INVALID_SEQ:
+            return "Packet out of sequence";
+        case FIDO_ERROR_MSG_TIMEOUT:
+            return "Device timed out waiting for the message";
+        case FIDO_ERROR_CHANNEL_BUSY:
+            return "Device is busy with another channel";
+        case FIDO_ERROR_LOCK_REQUIRED:
+            return "Device is locked by another channel";
+        case FIDO_ERROR_SYNC_FAIL:
+            return "Device lost the channel";
+        case FIDO_ERROR_OTHER:
+            return "Unspecified device error";
+        case FIDO_ERROR_NOT_ALLOWED:
+            return "Command not allowed, was the button pushed?";
+        case FIDO_ERROR_WRONG_LENGTH:
+            return "Wrong request length";
+        case FIDO_ERROR_WRONG_DATA:
+            return "Wrong request data";
+        case FIDO_ERROR_INS_NOT_SUPPORTED:
+            return "Instruction not supported";
+        case FIDO_ERROR_CLA_NOT_SUPPORTED:
+            return "Class not supported";
+        case FIDO_ERROR_APDU_OTHER:
+            return "Unknown status word";
+        case FIDO_ERROR_UNEXPECTED_STATE:
+            return "Key is in an unexpected state";
+        case FIDO_ERROR_INVALID_ARGUMENT:
+            return "Invalid argument";
+        default:
+            return "Unknown error";
+    }
 }
 
-int fido_recv_packet(libusb_device_handle *handle, FIDOInitPacket *packet) {
-    memset(packet, 0, sizeof(FIDOInitPacket));
+FIDORoute fido_route_packet(const FIDOCID cid, const uint8_t packet[FIDO_PACKET_SIZE]) {
+    if (memcmp(fido_packet_cid(packet), cid, FIDO_CID_LEN) != 0) {
+        return FIDO_ROUTE_DROP;
+    }
+    if (!fido_packet_is_init(packet)) {
+        return FIDO_ROUTE_DELIVER;
+    }
+    switch (fido_packet_cmd(packet)) {
+        case U2FHID_KEEPALIVE:
+            return FIDO_ROUTE_KEEPALIVE;
+        case U2FHID_ERROR:
+            if (fido_packet_bcnt(packet) >= 1 && fido_packet_data(packet)[0] == U2FHID_ERR_CHANNEL_BUSY) {
+                return FIDO_ROUTE_BUSY;
+            }
+            return FIDO_ROUTE_DELIVER;
+        default:
+            return FIDO_ROUTE_DELIVER;
+    }
+}
+
+int fido_send_message(USBDevice *dev, const FIDOCID cid, const uint8_t cmd, const uint8_t *data,
+                      const uint16_t data_len, const Deadline *deadline) {
+    if (data_len > FIDO_MAX_MESSAGE_LEN) {
+        log_error("Failed to send U2FHID message: Data too long");
+        return -1;
+    }
     uint8_t buf[FIDO_PACKET_SIZE];
-    memset(buf, 0, FIDO_PACKET_SIZE * sizeof(uint8_t));  // NOLINT (GCC doesn't support _s)
+    const size_t count = fido_packet_count(data_len);
+    for (size_t i = 0; i < count; i++) {
+        fido_build_packet(cid, cmd, data, data_len, i, buf);
+        if (usb_send(dev, buf, FIDO_PACKET_SIZE, deadline) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    int err = usb_recv(handle, buf, FIDO_PACKET_SIZE);
-    if (err != 0) {
+int fido_recv_message(USBDevice *dev, const FIDOCID cid, FIDOReassembly *reassembly, const Deadline *deadline) {
+    uint8_t buf[FIDO_PACKET_SIZE];
+    int done = 0;
+    while (done == 0) {
+        memset(buf, 0, FIDO_PACKET_SIZE * sizeof(uint8_t));  // NOLINT (GCC doesn't support _s)
+        if (usb_recv(dev, buf, FIDO_PACKET_SIZE, deadline) != 0) {
+            return -1;
+        }
+        switch (fido_route_packet(cid, buf)) {
+            case FIDO_ROUTE_DROP:
+                log_debug("Dropping packet meant for another channel");
+                break;
+            case FIDO_ROUTE_KEEPALIVE:
+                break;
+            case FIDO_ROUTE_BUSY:
+            case FIDO_ROUTE_DELIVER:
+            default:
+                done = fido_reassembly_feed(reassembly, buf);
+                break;
+        }
+    }
+    return done == 1 ? 0 : -1;
+}
+
+int fido_generate_nonce(uint8_t nonce[U2FHID_NONCE_LEN]) {
+#ifdef _WIN32
+    if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, nonce, U2FHID_NONCE_LEN, BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+        log_error("Failed to generate U2FHID nonce: BCryptGenRandom() failed");
         return -1;
     }
-    memcpy(packet->cid, buf + 0, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
-    packet->cmd = buf[4];
-    packet->bcnth = buf[5];
-    packet->bcntl = buf[6];
-    memcpy(packet->data, buf + 7, FIDO_PACKET_DATA_LEN);  // NOLINT (GCC doesn't support _s)
+#elif defined(__linux__)
+    size_t filled = 0;
+    while (filled < U2FHID_NONCE_LEN) {
+        const ssize_t n = getrandom(nonce + filled, U2FHID_NONCE_LEN - filled, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            log_error("Failed to generate U2FHID nonce: getrandom() failed");
+            return -1;
+        }
+        filled += (size_t)n;
+    }
+#else
+    arc4random_buf(nonce, U2FHID_NONCE_LEN);
+#endif
+    return 0;
+}
 
+int fido_check_init_response(const FIDOReassembly *resp, const uint8_t nonce[U2FHID_NONCE_LEN], FIDOCID cid) {
+    if (resp->cmd != U2FHID_INIT) {
+        log_error("Failed to allocate U2FHID channel: Unexpected response command type");
+        return -1;
+    }
+    if (resp->len < U2FHID_NONCE_LEN + FIDO_CID_LEN) {
+        log_error("Failed to allocate U2FHID channel: Response too short");
+        return -1;
+    }
+    if (memcmp(resp->buf, nonce, U2FHID_NONCE_LEN) != 0) {
+        log_error("Failed to allocate U2FHID channel: Nonce did not match");
+        return -1;
+    }
+    memcpy(cid, resp->buf + U2FHID_NONCE_LEN, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
     return 0;
 }
 
-FIDOInitPacket fido_craft_packet(const FIDOCID cid, const uint8_t cmd, const uint8_t data_len, const uint8_t *data) {
-    if (data_len > FIDO_PACKET_DATA_LEN) {
-        log_fatal("Failed to craft U2FHID packet: Data too long");
+// Run the callback, with a result of -1 unless error is FIDO_ERROR_NONE.
+static void fido_exchange_finish(FIDOExchange *exchange, const FIDOError error) {
+    usb_release_transfer(exchange->transfer);
+    exchange->transfer = NULL;
+    exchange->error = error;
+    exchange->callback(exchange, error == FIDO_ERROR_NONE ? 0 : -1);
+}
+
+// Classify a failed submission, which is refused once the deadline has passed.
+static FIDOError fido_submit_error(const FIDOExchange *exchange) {
+    if (deadline_is_cancelled(exchange->deadline)) {
+        return FIDO_ERROR_CANCELLED;
+    }
+    return deadline_expired(exchange->deadline) ? FIDO_ERROR_TIMEOUT : FIDO_ERROR_IO;
+}
+
+// Classify a transfer that failed for good, the same way usb_check_transfer() reports it.
+static FIDOError fido_transfer_error(const FIDOExchange *exchange) {
+    const int err = usb_async_result(exchange->transfer);
+    if (deadline_is_cancelled(exchange->deadline)) {
+        return FIDO_ERROR_CANCELLED;
+    }
+    if (err == LIBUSB_ERROR_TIMEOUT || (err == LIBUSB_ERROR_INTERRUPTED && deadline_expired(exchange->deadline))) {
+        return FIDO_ERROR_TIMEOUT;
     }
-    FIDOInitPacket packet = {0};
-    packet.cmd = cmd;
-    packet.bcntl = data_len;
-    memcpy(packet.cid, cid, FIDO_CID_LEN);
-    memcpy(packet.data, data, data_len);
-    return packet;
+    if (err == LIBUSB_ERROR_NO_DEVICE) {
+        return FIDO_ERROR_NO_DEVICE;
+    }
+    return FIDO_ERROR_IO;
 }
 
-bool fido_is_error_packet(const FIDOInitPacket packet) { return packet.cmd == U2FHID_ERROR; }
+static void fido_exchange_sent(USBTransfer *transfer);
 
-int fido_alloc_channel(libusb_device_handle *handle, FIDOCID cid) {
-    log_debug("Allocating channel");
-    // Craft alloc request packet
-    // The Windows programmer seems to always use this nonce
-    const uint8_t chosen_by_fair_dice_roll_guaranteed_to_be_random[U2FHID_NONCE_LEN] = {0xcd, 0x4b, 0x74, 0xbd,
-                                                                                        0x89, 0x5e, 0xa5, 0x00};
-    const FIDOInitPacket req = fido_craft_packet(U2FHID_BROADCAST_CID, U2FHID_INIT, U2FHID_NONCE_LEN,
-                                                 chosen_by_fair_dice_roll_guaranteed_to_be_random);
-    int err = fido_send_packet(handle, req);
-    if (err != 0) {
+// Account for a transfer about to be (re)submitted.
+static void fido_exchange_submitting(FIDOExchange *exchange) {
+    exchange->transfers++;
+    exchange->submitted_at_us = deadline_now_us();
+}
+
+// Account for a completed transfer. Returns usb_check_transfer()'s verdict on it.
+static int fido_exchange_check(FIDOExchange *exchange, USBTransfer *transfer, uint32_t *bytes) {
+    const uint64_t now_us = deadline_now_us();
+    exchange->device_wait_us += now_us - exchange->submitted_at_us;
+    const int err = usb_check_transfer(exchange->dev, transfer, exchange->deadline);
+    if (err == USB_TRANSFER_RETRYING) {
+        exchange->transfers++;
+        exchange->submitted_at_us = now_us;
+    } else if (err == 0) {
+        *bytes += (uint32_t)transfer->xfer->actual_length;
+    }
+    return err;
+}
+
+// Send the next packet of the request, or the channel allocation request while re-syncing.
+static int fido_exchange_send(FIDOExchange *exchange) {
+    uint8_t *frame = exchange->transfer->frame;
+    if (exchange->resyncing) {
+        fido_build_packet(U2FHID_BROADCAST_CID, U2FHID_INIT, exchange->nonce, U2FHID_NONCE_LEN, 0, frame);
+    } else {
+        fido_build_packet(exchange->cid, exchange->cmd, exchange->data, exchange->data_len, exchange->next_packet,
+                          frame);
+    }
+    fido_exchange_submitting(exchange);
+    return usb_submit_send(exchange->dev, exchange->transfer, frame, FIDO_PACKET_SIZE, exchange->deadline,
+                           fido_exchange_sent, exchange);
+}
+
+// Allocate a new channel, then repeat the request on it. Returns 0 if the re-sync has been started.
+static int fido_exchange_resync(FIDOExchange *exchange) {
+    if (exchange->resyncs >= FIDO_MAX_RESYNCS || deadline_expired(exchange->deadline)) {
+        return -1;
+    }
+    log_debug("Device lost the U2FHID channel, re-syncing");
+    exchange->resyncs++;
+    exchange->resets = exchange->dev->resets;
+    exchange->next_packet = 0;
+    // A channel allocation doesn't depend on any channel, so it's simply repeated
+    exchange->resyncing = exchange->cmd != U2FHID_INIT;
+    if (exchange->resyncing && fido_generate_nonce(exchange->nonce) != 0) {
         return -1;
     }
+    return fido_exchange_send(exchange);
+}
+
+static void fido_exchange_failed(FIDOExchange *exchange) {
+    // A reset loses the channel, but the device is usable again
+    if (exchange->dev->resets != exchange->resets && fido_exchange_resync(exchange) == 0) {
+        return;
+    }
+    fido_exchange_finish(exchange, fido_transfer_error(exchange));
+}
+
+static void fido_exchange_resynced(FIDOExchange *exchange) {
+    if (fido_check_init_response(&exchange->resync, exchange->nonce, exchange->cid) != 0) {
+        fido_exchange_finish(exchange, FIDO_ERROR_PROTOCOL);
+        return;
+    }
+    exchange->resyncing = false;
+    if (fido_exchange_send(exchange) != 0) {
+        fido_exchange_finish(exchange, fido_submit_error(exchange));
+    }
+}
+
+static void fido_exchange_received(USBTransfer *transfer);
 
-    // Parse response packet
-    FIDOInitPacket resp;
-    err = fido_recv_packet(handle, &resp);
+static int fido_exchange_recv(FIDOExchange *exchange) {
+    USBTransfer *transfer = exchange->transfer;
+    memset(transfer->frame, 0, FIDO_PACKET_SIZE * sizeof(uint8_t));  // NOLINT (GCC doesn't support _s)
+    fido_exchange_submitting(exchange);
+    return usb_submit_recv(exchange->dev, transfer, transfer->frame, FIDO_PACKET_SIZE, exchange->deadline,
+                           fido_exchange_received, exchange);
+}
+
+// Deal with packets received in the meantime that aren't part of the response.
+// Returns FIDO_ROUTE_DELIVER if the packet is, otherwise the exchange has been continued or finished.
+static FIDORoute fido_exchange_route(FIDOExchange *exchange) {
+    const uint8_t *packet = exchange->transfer->frame;
+    const FIDORoute route = fido_route_packet(exchange->resyncing ? U2FHID_BROADCAST_CID : exchange->cid, packet);
+    uint8_t status = 0;
+    FIDOError err = FIDO_ERROR_NONE;
+    switch (route) {
+        case FIDO_ROUTE_DROP:
+            log_debug("Dropping packet meant for another channel");
+            err = fido_exchange_recv(exchange) == 0 ? FIDO_ERROR_NONE : fido_submit_error(exchange);
+            break;
+        case FIDO_ROUTE_KEEPALIVE:
+            status = fido_packet_bcnt(packet) >= 1 ? fido_packet_data(packet)[0] : 0;
+            exchange->keepalives++;
+            exchange->keepalive_status = status;
+            if (exchange->progress != NULL) {
+                exchange->progress(exchange, route, status);
+            }
+            err = fido_exchange_recv(exchange) == 0 ? FIDO_ERROR_NONE : fido_submit_error(exchange);
+            break;
+        case FIDO_ROUTE_BUSY:
+            if (exchange->busy_retries >= FIDO_MAX_BUSY_RETRIES || deadline_expired(exchange->deadline)) {
+                log_error("Failed to exchange U2FHID message: Device is busy with another channel");
+                err = FIDO_ERROR_CHANNEL_BUSY;
+                break;
+            }
+            log_debug("Device is busy with another channel, repeating request");
+            exchange->busy_retries++;
+            if (exchange->progress != NULL) {
+                exchange->progress(exchange, route, 0);
+            }
+            exchange->next_packet = 0;
+            err = fido_exchange_send(exchange) == 0 ? FIDO_ERROR_NONE : fido_submit_error(exchange);
+            break;
+        case FIDO_ROUTE_DELIVER:
+        default:
+            return FIDO_ROUTE_DELIVER;
+    }
+    if (err != FIDO_ERROR_NONE) {
+        fido_exchange_finish(exchange, err);
+    }
+    return route;
+}
+
+static void fido_exchange_received(USBTransfer *transfer) {
+    FIDOExchange *exchange = (FIDOExchange *)transfer->user_data;
+    const int err = fido_exchange_check(exchange, transfer, &exchange->bytes_received);
+    if (err == USB_TRANSFER_RETRYING) {
+        return;
+    }
     if (err != 0) {
-        return -1;
+        fido_exchange_failed(exchange);
+        return;
     }
-    // Check packet type
-    if (resp.cmd != U2FHID_INIT) {
-        log_error("Failed to allocate U2FHID channel: Unexpected response command type");
+    if (fido_exchange_route(exchange) != FIDO_ROUTE_DELIVER) {
+        return;
+    }
+    FIDOReassembly *reassembly = exchange->resyncing ? &exchange->resync : &exchange->response;
+    const int done = fido_reassembly_feed(reassembly, transfer->frame);
+    if (done == 0) {
+        if (fido_exchange_recv(exchange) != 0) {
+            fido_exchange_finish(exchange, fido_submit_error(exchange));
+        }
+        return;
+    }
+    if (done != 1) {
+        fido_exchange_finish(exchange, FIDO_ERROR_PROTOCOL);
+        return;
+    }
+    if (exchange->resyncing) {
+        fido_exchange_resynced(exchange);
+        return;
+    }
+    // Other error responses are complete responses, which the caller decodes through fido_message_error()
+    if (fido_message_error(&exchange->response) == FIDO_ERROR_SYNC_FAIL && fido_exchange_resync(exchange) == 0) {
+        return;
     }
-    // Check nonce
-    if (strncmp((const char *)resp.data, (const char *)chosen_by_fair_dice_roll_guaranteed_to_be_random,
-                U2FHID_NONCE_LEN) == 0) {
-        log_debug("Nonce checks out");
+    fido_exchange_finish(exchange, FIDO_ERROR_NONE);
+}
+
+static void fido_exchange_sent(USBTransfer *transfer) {
+    FIDOExchange *exchange = (FIDOExchange *)transfer->user_data;
+    const int err = fido_exchange_check(exchange, transfer, &exchange->bytes_sent);
+    if (err == USB_TRANSFER_RETRYING) {
+        return;
+    }
+    if (err != 0) {
+        fido_exchange_failed(exchange);
+        return;
+    }
+    int submit_err = 0;
+    if (!exchange->resyncing && ++exchange->next_packet < fido_packet_count(exchange->data_len)) {
+        submit_err = fido_exchange_send(exchange);
     } else {
-        log_error("Failed to allocate U2FHID channel: Nonce did not match");
+        // Reuse the transfer and frame for the response, whose packets are reassembled as they arrive
+        if (exchange->resyncing) {
+            fido_reassembly_init(&exchange->resync, exchange->resync_buf, sizeof(exchange->resync_buf));
+        } else {
+            fido_reassembly_init(&exchange->response, exchange->response.buf, exchange->response.buf_len);
+        }
+        submit_err = fido_exchange_recv(exchange);
+    }
+    if (submit_err != 0) {
+        fido_exchange_finish(exchange, fido_submit_error(exchange));
+    }
+}
+
+int fido_exchange_start(FIDOExchange *exchange, USBDevice *dev, const FIDOCID cid, const uint8_t cmd,
+                        const uint8_t *data, const uint16_t data_len, uint8_t *resp_buf, const size_t resp_buf_len,
+                        const Deadline *deadline, FIDOExchangeCallback callback, void *user_data) {
+    if (data_len > FIDO_MAX_MESSAGE_LEN) {
+        log_error("Failed to send U2FHID message: Data too long");
+        exchange->error = FIDO_ERROR_INVALID_ARGUMENT;
+        return -1;
+    }
+    memset(exchange, 0, sizeof(FIDOExchange));  // NOLINT (GCC doesn't support _s)
+    exchange->dev = dev;
+    exchange->deadline = deadline;
+    memcpy(exchange->cid, cid, FIDO_CID_LEN);  // NOLINT (GCC doesn't support _s)
+    exchange->cmd = cmd;
+    exchange->data = data;
+    exchange->data_len = data_len;
+    fido_reassembly_init(&exchange->response, resp_buf, resp_buf_len);
+    exchange->resets = dev->resets;
+    exchange->callback = callback;
+    exchange->user_data = user_data;
+    exchange->transfer = usb_acquire_transfer(dev);
+    if (exchange->transfer == NULL) {
+        exchange->error = FIDO_ERROR_IO;
+        return -1;
+    }
+    int err = fido_exchange_send(exchange);
+    if (err != 0) {
+        usb_release_transfer(exchange->transfer);
+        exchange->error = fido_submit_error(exchange);
+        exchange->transfer = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int fido_exchange_cancel(FIDOExchange *exchange) {
+    if (exchange->transfer == NULL) {
+        return 0;
+    }
+    return usb_cancel_transfer(exchange->dev, exchange->transfer);
+}
+
+int fido_alloc_channel(USBDevice *dev, FIDOCID cid, const Deadline *deadline) {
+    log_debug("Allocating channel");
+    uint8_t nonce[U2FHID_NONCE_LEN];
+    uint8_t resp_buf[FIDO_PACKET_DATA_LEN];
+    FIDOReassembly resp;
+    int err = 0;
+    for (int attempt = 0; attempt <= FIDO_MAX_RESYNCS; attempt++) {
+        const uint32_t resets = dev->resets;
+        if (fido_generate_nonce(nonce) != 0) {
+            return -1;
+        }
+        fido_reassembly_init(&resp, resp_buf, sizeof(resp_buf));
+        err = fido_send_message(dev, U2FHID_BROADCAST_CID, U2FHID_INIT, nonce, U2FHID_NONCE_LEN, deadline);
+        if (err == 0) {
+            err = fido_recv_message(dev, U2FHID_BROADCAST_CID, &resp, deadline);
+        }
+        // Allocation doesn't depend on any channel, so simply start over once the device has been reset
+        if (err == 0 || dev->resets == resets) {
+            break;
+        }
+    }
+    if (err != 0) {
+        return -1;
+    }
+    if (fido_check_init_response(&resp, nonce, cid) != 0) {
+        return -1;
     }
-    // Extract CID
-    memcpy(cid, resp.data + U2FHID_NONCE_LEN, FIDO_CID_LEN * sizeof(uint8_t));
     log_debug("Allocated channel");
     return 0;
 }
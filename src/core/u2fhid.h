@@ -2,40 +2,295 @@
 
 #include <libusb.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "deadline.h"
+#include "usb.h"
+#include "usb_async.h"
+
 #define FIDO_PACKET_SIZE     64
 #define FIDO_CID_LEN         4
 #define FIDO_PACKET_DATA_LEN 57
+// Payload carried by a continuation packet
+#define FIDO_CONT_DATA_LEN 59
+// Continuation packets are numbered 0 to this
+#define FIDO_MAX_SEQ 0x7f
+// Longest payload a message can carry, in an initialization packet followed by all continuation packets
+#define FIDO_MAX_MESSAGE_LEN (FIDO_PACKET_DATA_LEN + (FIDO_MAX_SEQ + 1) * FIDO_CONT_DATA_LEN)
+
+// Set in the command byte of initialization packets, clear in the sequence byte of continuation packets
+#define U2FHID_TYPE_INIT 0x80
 
+#define U2FHID_LOCK      0x84
 #define U2FHID_INIT      0x86
+#define U2FHID_WINK      0x88
+#define U2FHID_KEEPALIVE 0xBB
 #define U2FHID_ERROR     0xBF
 #define U2FHID_ADPU_RAW  0x83
 #define U2FHID_NONCE_LEN 8
 
+// Longest a lock can be held for before it has to be renewed
+#define U2FHID_MAX_LOCK_SECONDS 10
+
+// Error codes carried by U2FHID_ERROR responses
+#define U2FHID_ERR_INVALID_CMD 0x01
+#define U2FHID_ERR_INVALID_PAR 0x02
+#define U2FHID_ERR_INVALID_LEN 0x03
+#define U2FHID_ERR_INVALID_SEQ 0x04
+#define U2FHID_ERR_MSG_TIMEOUT 0x05
+// Reported if the device is in the middle of a transaction on another channel
+#define U2FHID_ERR_CHANNEL_BUSY 0x06
+#define U2FHID_ERR_LOCK_REQUIRED 0x0A
+// Reported if the device doesn't know the channel, e.g. after having been reset
+#define U2FHID_ERR_SYNC_FAIL 0x0B
+#define U2FHID_ERR_OTHER     0x7F
+
+// Status carried by keepalive packets
+#define U2FHID_KEEPALIVE_PROCESSING 0x01
+#define U2FHID_KEEPALIVE_UP_NEEDED  0x02
+
+// How often an exchange allocates a new channel and retries, after the device has lost the old one
+#define FIDO_MAX_RESYNCS 2
+
+// How often an exchange repeats a request the device rejected because it was busy with another channel
+#define FIDO_MAX_BUSY_RETRIES 8
+
 // FIDO channel ID
 typedef uint8_t FIDOCID[4];
 
-// FIDO message initial packet
+// Byte offsets within a packet on the wire
+#define FIDO_PACKET_CID_OFFSET       0
+#define FIDO_PACKET_CMD_OFFSET       4
+#define FIDO_PACKET_SEQ_OFFSET       4
+#define FIDO_PACKET_BCNTH_OFFSET     5
+#define FIDO_PACKET_BCNTL_OFFSET     6
+#define FIDO_PACKET_DATA_OFFSET      7
+#define FIDO_PACKET_CONT_DATA_OFFSET 5
+
+// Reassembles a message from its initialization and continuation packets, straight into a caller-supplied buffer.
+// Once complete, it's also the view through which the message is read.
 typedef struct {
-    // Channel ID
+    uint8_t *buf;
+    size_t buf_len;
+    // Taken from the initialization packet
+    FIDOCID cid;
+    uint8_t cmd;
+    uint16_t len;
+    // Payload bytes received so far
+    uint16_t received;
+    uint8_t next_seq;
+    bool started;
+} FIDOReassembly;
+
+// Why talking to the device failed, decoded from transfer results, U2FHID error codes and APDU status words.
+typedef enum {
+    FIDO_ERROR_NONE,
+    // Transport
+    FIDO_ERROR_TIMEOUT,
+    FIDO_ERROR_CANCELLED,
+    FIDO_ERROR_NO_DEVICE,
+    FIDO_ERROR_IO,
+    // Response that doesn't follow the protocol, e.g. a mismatched nonce or a malformed message
+    FIDO_ERROR_PROTOCOL,
+    // U2FHID error codes
+    FIDO_ERROR_INVALID_CMD,
+    FIDO_ERROR_INVALID_PAR,
+    FIDO_ERROR_INVALID_LEN,
+    FIDO_ERROR_INVALID_SEQ,
+    FIDO_ERROR_MSG_TIMEOUT,
+    FIDO_ERROR_CHANNEL_BUSY,
+    FIDO_ERROR_LOCK_REQUIRED,
+    FIDO_ERROR_SYNC_FAIL,
+    FIDO_ERROR_OTHER,
+    // APDU status words: 0x69xx (e.g. the button wasn't pushed in time), 0x6700, 0x6a80, 0x6d00, 0x6e00, and the rest
+    FIDO_ERROR_NOT_ALLOWED,
+    FIDO_ERROR_WRONG_LENGTH,
+    FIDO_ERROR_WRONG_DATA,
+    FIDO_ERROR_INS_NOT_SUPPORTED,
+    FIDO_ERROR_CLA_NOT_SUPPORTED,
+    FIDO_ERROR_APDU_OTHER,
+    // Raised above the protocol: The key isn't in the state the operation needs (e.g. already programmed), or the
+    // request itself is invalid
+    FIDO_ERROR_UNEXPECTED_STATE,
+    FIDO_ERROR_INVALID_ARGUMENT,
+} FIDOError;
+
+// What to do with a received packet, as decided by fido_route_packet().
+typedef enum {
+    // Part of the response on the expected channel
+    FIDO_ROUTE_DELIVER,
+    // Meant for another channel, e.g. an abandoned one or one belonging to another U2F client
+    FIDO_ROUTE_DROP,
+    // The device is still working on the request, e.g. waiting for the button to be pushed
+    FIDO_ROUTE_KEEPALIVE,
+    // The device rejected the request because it's busy with another channel
+    FIDO_ROUTE_BUSY,
+} FIDORoute;
+
+typedef struct FIDOExchange FIDOExchange;
+
+// Run once the exchange has finished. result is 0 if a response was received, -1 on failure.
+typedef void (*FIDOExchangeCallback)(FIDOExchange *exchange, const int result);
+
+// Run whenever the device signals progress on the request (FIDO_ROUTE_KEEPALIVE or FIDO_ROUTE_BUSY) in the meantime.
+// status is the keepalive status, 0 for FIDO_ROUTE_BUSY.
+typedef void (*FIDOExchangeProgressCallback)(FIDOExchange *exchange, const FIDORoute event, const uint8_t status);
+
+// A request message and its response, exchanged without blocking.
+// If the device gets reset or forgets the channel meanwhile, a new channel is allocated and the request is repeated.
+struct FIDOExchange {
+    USBDevice *dev;
+    const Deadline *deadline;
+    // Taken from the device's pool, its frame holds each packet sent and received in turn
+    USBTransfer *transfer;
+    // Channel the request ends up being sent on, differs from the original one after a re-sync
     FIDOCID cid;
-    // Command ID
+    // Request, the payload has to stay valid until the callback has been run
     uint8_t cmd;
-    // Payload length (high part)
-    uint8_t bcnth;
-    // Payload length (low part)
-    uint8_t bcntl;
-    // Payload data
-    uint8_t data[FIDO_PACKET_DATA_LEN];
-} FIDOInitPacket;
+    const uint8_t *data;
+    uint16_t data_len;
+    // Next packet of the request to send
+    size_t next_packet;
+    // Response, valid once the callback has been run with a result of 0
+    FIDOReassembly response;
+    // Re-sync state, the channel allocation response is reassembled into its own small buffer
+    uint32_t resets;
+    int resyncs;
+    bool resyncing;
+    FIDOReassembly resync;
+    uint8_t resync_buf[FIDO_PACKET_DATA_LEN];
+    uint8_t nonce[U2FHID_NONCE_LEN];
+    // Why the exchange failed, set before the callback is run with a result of -1
+    FIDOError error;
+    // Accounting: Transfers submitted (including resubmissions and packets for other channels) and bytes they moved
+    uint32_t transfers;
+    uint32_t bytes_sent;
+    uint32_t bytes_received;
+    // Time from submitting transfers until they completed, i.e. waiting for the device (and the button) to answer
+    uint64_t device_wait_us;
+    uint64_t submitted_at_us;
+    // Progress the device signalled so far
+    uint32_t keepalives;
+    uint8_t keepalive_status;
+    int busy_retries;
+    FIDOExchangeCallback callback;
+    // Optional, may be set once fido_exchange_start() has returned
+    FIDOExchangeProgressCallback progress;
+    void *user_data;
+};
+
+/*
+ * Accessors reading a packet in place, e.g. straight out of a transfer's frame buffer.
+ * Which of them make sense depends on fido_packet_is_init().
+ */
+bool fido_packet_is_init(const uint8_t packet[FIDO_PACKET_SIZE]);
+const uint8_t *fido_packet_cid(const uint8_t packet[FIDO_PACKET_SIZE]);
+uint8_t fido_packet_cmd(const uint8_t packet[FIDO_PACKET_SIZE]);
+uint8_t fido_packet_seq(const uint8_t packet[FIDO_PACKET_SIZE]);
+// Payload length of the whole message, announced by its initialization packet
+uint16_t fido_packet_bcnt(const uint8_t packet[FIDO_PACKET_SIZE]);
+const uint8_t *fido_packet_data(const uint8_t packet[FIDO_PACKET_SIZE]);
+
+/*
+ * Zero the packet and write the header of an initialization packet into it.
+ * Returns where the payload goes, so that it can be written in place.
+ */
+uint8_t *fido_packet_init(uint8_t packet[FIDO_PACKET_SIZE], const FIDOCID cid, const uint8_t cmd,
+                          const uint16_t bcnt);
+
+// Number of packets a message with the given payload length is split into.
+size_t fido_packet_count(const uint16_t data_len);
+
+/*
+ * Write the given packet (0 being the initialization packet) of a message into a packet-sized buffer.
+ * data_len must not exceed FIDO_MAX_MESSAGE_LEN.
+ */
+void fido_build_packet(const FIDOCID cid, const uint8_t cmd, const uint8_t *data, const uint16_t data_len,
+                       const size_t index, uint8_t packet[FIDO_PACKET_SIZE]);
+
+void fido_reassembly_init(FIDOReassembly *reassembly, uint8_t *buf, const size_t buf_len);
+
+/*
+ * Add a received packet to the message.
+ * Returns 1 once the message is complete, 0 if more packets are needed, -1 on failure (e.g. if it doesn't fit).
+ * Error message is obtainable through the log module.
+ */
+int fido_reassembly_feed(FIDOReassembly *reassembly, const uint8_t packet[FIDO_PACKET_SIZE]);
+
+// Whether a complete message is an error response.
+bool fido_message_is_error(const FIDOReassembly *message);
+
+// Decode the error code of a complete message. Returns FIDO_ERROR_NONE if it isn't an error response.
+FIDOError fido_message_error(const FIDOReassembly *message);
+
+// Decode an APDU status word (SW1 in the high byte). Returns FIDO_ERROR_NONE for success (0x90xx).
+FIDOError fido_status_word_error(const uint16_t status_word);
+
+/*
+ * Whether repeating the operation that failed with the given error can succeed, e.g. once the device is no longer busy
+ * or the button does get pushed. Errors caused by the request or the state of the key are never retryable.
+ */
+bool fido_error_is_retryable(const FIDOError error);
+
+// Short description of the error.
+const char *fido_error_string(const FIDOError error);
+
+// Decide what to do with a packet received while waiting for a response on the given channel.
+FIDORoute fido_route_packet(const FIDOCID cid, const uint8_t packet[FIDO_PACKET_SIZE]);
+
+/*
+ * Send a message of up to FIDO_MAX_MESSAGE_LEN bytes, split into as many packets as needed.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int fido_send_message(USBDevice *dev, const FIDOCID cid, const uint8_t cmd, const uint8_t *data,
+                      const uint16_t data_len, const Deadline *deadline);
+
+/*
+ * Receive a message on the given channel into the reassembly's buffer.
+ * Packets for other channels and keepalives are skipped, a busy error is returned like any other message.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int fido_recv_message(USBDevice *dev, const FIDOCID cid, FIDOReassembly *reassembly, const Deadline *deadline);
 
-FIDOInitPacket fido_craft_packet(const FIDOCID cid, const uint8_t cmd, const uint8_t data_len, const uint8_t *data);
+/*
+ * Send the request message and receive the response in the background, into resp_buf.
+ * The callback is run from usb_context_handle_events() once done.
+ * Packets are routed through fido_route_packet(): Keepalives are waited out and busy rejections retried.
+ * The exchange, deadline and both buffers must stay valid until then.
+ * Returns 0 on success, -1 on failure (in which case the callback isn't run, but exchange->error is set).
+ * Error message is obtainable through the log module.
+ */
+int fido_exchange_start(FIDOExchange *exchange, USBDevice *dev, const FIDOCID cid, const uint8_t cmd,
+                        const uint8_t *data, const uint16_t data_len, uint8_t *resp_buf, const size_t resp_buf_len,
+                        const Deadline *deadline, FIDOExchangeCallback callback, void *user_data);
 
-int fido_send_packet(libusb_device_handle *handle, const FIDOInitPacket packet);
+/*
+ * Abort the exchange. The callback still gets run, with a failed result.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int fido_exchange_cancel(FIDOExchange *exchange);
 
-int fido_recv_packet(libusb_device_handle *handle, FIDOInitPacket *packet);
+/*
+ * Fill the nonce of a channel allocation request from the operating system's CSPRNG.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int fido_generate_nonce(uint8_t nonce[U2FHID_NONCE_LEN]);
 
-int fido_alloc_channel(libusb_device_handle *handle, FIDOCID cid);
+/*
+ * Check that a channel allocation response answers the request with the given nonce, and extract the new channel.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int fido_check_init_response(const FIDOReassembly *resp, const uint8_t nonce[U2FHID_NONCE_LEN], FIDOCID cid);
 
-bool fido_is_error_packet(const FIDOInitPacket packet);
+/*
+ * Allocate a new channel with a random nonce.
+ * Returns 0 on success, -1 on failure (including a response that doesn't match the nonce).
+ * Error message is obtainable through the log module.
+ */
+int fido_alloc_channel(USBDevice *dev, FIDOCID cid, const Deadline *deadline);
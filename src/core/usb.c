@@ -1,11 +1,17 @@
 #include "usb.h"
 
 #include <libusb.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "deadline.h"
 #include "log.h"
+#include "usb_async.h"
+#include "usb_hidraw.h"
 
 // There are revisions with different vendor IDs floating around
 #define HYPERSECU_VID_1 0x2ccf
@@ -14,149 +20,989 @@
 // Not sure whether this list is exhaustive
 #define HYPERFIDO_PID 0x0854
 
-// Might be better to discover this dynamically
-#define HYPERHOTP_IFACE_NUM    1
-#define HYPERHOTP_IN_ENDPOINT  0x83
-#define HYPERHOTP_OUT_ENDPOINT 0x04
+// FIDO U2FHID reports are always this large
+#define USB_FIDO_REPORT_SIZE 64
 
-static bool is_wanted_device(libusb_device *dev) {
-    struct libusb_device_descriptor desc = {0};
-    int err = libusb_get_device_descriptor(dev, &desc);
+static const struct {
+    uint16_t vendor_id;
+    uint16_t product_id;
+} USB_SUPPORTED_IDS[USB_NUM_SUPPORTED_IDS] = {
+    {HYPERSECU_VID_1, HYPERFIDO_PID},
+    {HYPERSECU_VID_2, HYPERFIDO_PID},
+};
+
+int usb_context_init(USBContext **ctx) {
+    *ctx = NULL;
+    USBContext *c = (USBContext *)calloc(1, sizeof(USBContext));
+    if (c == NULL) {
+        log_error("Failed to init libusb: Out of memory");
+        return -1;
+    }
+    int err = libusb_init(&c->ctx);
+    if (err != 0) {
+        log_error_libusb("Failed to init libusb", err);
+        free(c);
+        return -1;
+    }
+
+    // Configure debugging
+#ifdef DEBUG
+    err = libusb_set_option(c->ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
     if (err != 0) {
-        log_fatal("Could not get descriptor for device");
+        log_error_libusb("Failed to set libusb log level", err);
+        libusb_exit(c->ctx);
+        free(c);
+        return -1;
+    }
+    libusb_set_log_cb(c->ctx, log_libusb_callback, LIBUSB_LOG_CB_CONTEXT);
+#endif
+
+#ifdef __linux__
+    c->wake_fd = usb_hidraw_wake_open();
+    if (c->wake_fd < 0) {
+        libusb_exit(c->ctx);
+        free(c);
+        return -1;
+    }
+#else
+    c->wake_fd = -1;
+#endif
+
+    usb_async_queue_init(&c->completions);
+    *ctx = c;
+    return 0;
+}
+
+static enum libusb_transfer_status usb_hidraw_status(const int err) {
+    switch (err) {
+        case LIBUSB_ERROR_NO_DEVICE:
+            return LIBUSB_TRANSFER_NO_DEVICE;
+        case LIBUSB_ERROR_TIMEOUT:
+            return LIBUSB_TRANSFER_TIMED_OUT;
+        case LIBUSB_ERROR_PIPE:
+            return LIBUSB_TRANSFER_STALL;
+        default:
+            return LIBUSB_TRANSFER_ERROR;
+    }
+}
+
+static void usb_hidraw_unlink_read(USBContext *ctx, USBTransfer *transfer) {
+    USBTransfer *prev = NULL;
+    for (USBTransfer *curr = ctx->hidraw_reads; curr != NULL; prev = curr, curr = curr->next) {
+        if (curr != transfer) {
+            continue;
+        }
+        if (prev != NULL) {
+            prev->next = curr->next;
+        } else {
+            ctx->hidraw_reads = curr->next;
+        }
+        curr->next = NULL;
+        return;
+    }
+}
+
+static void usb_hidraw_finish(USBContext *ctx, USBTransfer *transfer, const enum libusb_transfer_status status,
+                              const int actual_length) {
+    usb_hidraw_unlink_read(ctx, transfer);
+    transfer->xfer->status = status;
+    transfer->xfer->actual_length = actual_length;
+    usb_async_complete(transfer);
+}
+
+// Add libusb's file descriptors to the ones to wait on. Returns the new count.
+static size_t usb_add_libusb_pollfds(USBContext *ctx, USBPollFd *fds, size_t n) {
+    const struct libusb_pollfd **pollfds = libusb_get_pollfds(ctx->ctx);
+    if (pollfds == NULL) {
+        return n;
+    }
+    for (size_t i = 0; pollfds[i] != NULL && n < USB_HIDRAW_MAX_POLL_FDS; i++) {
+        fds[n].fd = pollfds[i]->fd;
+        fds[n].events = pollfds[i]->events;
+        n++;
+    }
+    libusb_free_pollfds(pollfds);
+    return n;
+}
+
+/*
+ * Wait at most timeout_ms for pending hidraw receives, libusb's file descriptors or a wakeup, and complete the
+ * receives that got their report or timed out. Whatever libusb has ready is left for the caller to handle.
+ */
+static int usb_hidraw_handle_reads(USBContext *ctx, const int timeout_ms) {
+    USBPollFd fds[USB_HIDRAW_MAX_POLL_FDS];
+    bool ready[USB_HIDRAW_MAX_POLL_FDS] = {false};
+    size_t num_reads = 0;
+    for (USBTransfer *t = ctx->hidraw_reads; t != NULL && num_reads < USB_HIDRAW_MAX_POLL; t = t->next) {
+        fds[num_reads].fd = t->fd;
+        fds[num_reads].events = USB_HIDRAW_POLL_EVENTS;
+        num_reads++;
+    }
+    size_t n = usb_add_libusb_pollfds(ctx, fds, num_reads);
+    const size_t wake_index = n;
+    if (ctx->wake_fd >= 0 && n < USB_HIDRAW_MAX_POLL_FDS) {
+        fds[n].fd = ctx->wake_fd;
+        fds[n].events = USB_HIDRAW_POLL_EVENTS;
+        n++;
+    }
+    // Don't sleep through a receive's or one of libusb's transfers' timeout
+    int wait_ms = timeout_ms;
+    const int next_ms = usb_context_next_timeout(ctx);
+    if (next_ms >= 0 && (wait_ms < 0 || next_ms < wait_ms)) {
+        wait_ms = next_ms;
+    }
+    if (usb_hidraw_poll(fds, ready, n, wait_ms) != 0) {
+        return -1;
+    }
+    if (wake_index < n && ready[wake_index]) {
+        usb_hidraw_wake_drain(ctx->wake_fd);
+    }
+
+    const uint64_t now = deadline_now_ms();
+    size_t i = 0;
+    for (USBTransfer *t = ctx->hidraw_reads; t != NULL && i < num_reads; i++) {
+        USBTransfer *next = t->next;
+        int received = 0;
+        if (ready[i]) {
+            received = usb_hidraw_read(t->fd, t->xfer->buffer, (uint8_t)t->xfer->length);
+        }
+        if (received > 0) {
+            usb_hidraw_finish(ctx, t, LIBUSB_TRANSFER_COMPLETED, received);
+        } else if (received < 0) {
+            usb_hidraw_finish(ctx, t, usb_hidraw_status(received), 0);
+        } else if (t->expires_at_ms != DEADLINE_INFINITE && now >= t->expires_at_ms) {
+            usb_hidraw_finish(ctx, t, LIBUSB_TRANSFER_TIMED_OUT, 0);
+        }
+        t = next;
+    }
+    return 0;
+}
+
+int usb_context_handle_events(USBContext *ctx, const int timeout_ms) {
+    // Sends over hidraw complete right away, so give their callbacks a chance to submit the matching receive
+    usb_async_dispatch(&ctx->completions);
+    int err = 0;
+    int libusb_timeout_ms = timeout_ms;
+    if (ctx->hidraw_reads != NULL) {
+        // hidraw nodes aren't part of libusb's event loop, so wait on them together with libusb's file descriptors and
+        // only look at what libusb has ready
+        err = usb_hidraw_handle_reads(ctx, timeout_ms);
+        libusb_timeout_ms = 0;
+    }
+    if (usb_async_handle_events(ctx->ctx, libusb_timeout_ms) != 0) {
+        err = -1;
+    }
+    usb_async_dispatch(&ctx->completions);
+    return err;
+}
+
+void usb_context_wake(USBContext *ctx) {
+    if (ctx->wake_fd >= 0) {
+        usb_hidraw_wake(ctx->wake_fd);
+    }
+    libusb_interrupt_event_handler(ctx->ctx);
+}
+
+int usb_context_get_pollfds(USBContext *ctx, USBPollFd **fds, size_t *count) {
+    *fds = NULL;
+    *count = 0;
+    const struct libusb_pollfd **pollfds = libusb_get_pollfds(ctx->ctx);
+    if (pollfds == NULL) {
+        log_error("Failed to get file descriptors to poll: Not supported on this platform");
+        return -1;
+    }
+    size_t n = 0;
+    while (pollfds[n] != NULL) {
+        n++;
+    }
+    size_t num_hidraw = 0;
+    for (const USBDevice *dev = ctx->hidraw_devices; dev != NULL; dev = dev->next_hidraw) {
+        num_hidraw++;
+    }
+    USBPollFd *out = (USBPollFd *)calloc(n + num_hidraw + 1, sizeof(USBPollFd));
+    if (out == NULL) {
+        libusb_free_pollfds(pollfds);
+        log_error("Failed to get file descriptors to poll: Out of memory");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        out[i].fd = pollfds[i]->fd;
+        out[i].events = pollfds[i]->events;
+    }
+    libusb_free_pollfds(pollfds);
+    for (const USBDevice *dev = ctx->hidraw_devices; dev != NULL; dev = dev->next_hidraw) {
+        out[n].fd = dev->hidraw_fd;
+        out[n].events = USB_HIDRAW_POLL_EVENTS;
+        n++;
+    }
+    *fds = out;
+    *count = n;
+    return 0;
+}
+
+void usb_context_free_pollfds(USBPollFd *fds) { free(fds); }
+
+void usb_context_set_pollfd_notifiers(USBContext *ctx, USBPollFdAddedCallback added, USBPollFdRemovedCallback removed,
+                                      void *user_data) {
+    ctx->pollfd_added = added;
+    ctx->pollfd_removed = removed;
+    ctx->pollfd_user_data = user_data;
+    libusb_set_pollfd_notifiers(ctx->ctx, added, removed, user_data);
+}
+
+// Time until the first pending hidraw receive times out, or -1 if none does.
+static int usb_hidraw_next_timeout(const USBContext *ctx) {
+    uint64_t next_ms = DEADLINE_INFINITE;
+    const uint64_t now = deadline_now_ms();
+    for (const USBTransfer *t = ctx->hidraw_reads; t != NULL; t = t->next) {
+        if (t->expires_at_ms == DEADLINE_INFINITE) {
+            continue;
+        }
+        const uint64_t remaining = t->expires_at_ms > now ? t->expires_at_ms - now : 0;
+        next_ms = remaining < next_ms ? remaining : next_ms;
+    }
+    if (next_ms == DEADLINE_INFINITE) {
+        return -1;
+    }
+    return next_ms > INT_MAX ? INT_MAX : (int)next_ms;
+}
+
+int usb_context_next_timeout(USBContext *ctx) {
+    const int hidraw_ms = usb_hidraw_next_timeout(ctx);
+    // If the OS takes care of timeouts (e.g. timerfd on Linux), they're signalled through one of the poll fds
+    if (libusb_pollfds_handle_timeouts(ctx->ctx)) {
+        return hidraw_ms;
+    }
+    struct timeval tv = {0};
+    int err = libusb_get_next_timeout(ctx->ctx, &tv);
+    if (err <= 0) {
+        return hidraw_ms;
+    }
+    const long ms = (long)tv.tv_sec * 1000 + (long)tv.tv_usec / 1000;
+    const int libusb_ms = ms > INT_MAX ? INT_MAX : (int)ms;
+    return hidraw_ms >= 0 && hidraw_ms < libusb_ms ? hidraw_ms : libusb_ms;
+}
+
+void usb_context_set_backend(USBContext *ctx, const USBBackend backend) { ctx->backend = backend; }
+
+void usb_context_cleanup(USBContext *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    if (ctx->wake_fd >= 0) {
+        usb_hidraw_wake_close(ctx->wake_fd);
     }
+    libusb_exit(ctx->ctx);
+    free(ctx);
+}
 
-    // TODO: Support all VIDs/PIDs
-    if (desc.idVendor != HYPERSECU_VID_1) {
+// Devices whose descriptor can't be read are skipped, rather than taking down e.g. a hotplug watcher.
+static bool is_wanted_device(libusb_device *dev, struct libusb_device_descriptor *desc) {
+    int err = libusb_get_device_descriptor(dev, desc);
+    if (err != 0) {
+        log_error_libusb("Could not get descriptor for device, skipping it", err);
         return false;
     }
-    if (desc.idProduct != HYPERFIDO_PID) {
+
+    for (size_t i = 0; i < USB_NUM_SUPPORTED_IDS; i++) {
+        if (desc->idVendor == USB_SUPPORTED_IDS[i].vendor_id && desc->idProduct == USB_SUPPORTED_IDS[i].product_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const USBEndpointCacheEntry *usb_endpoint_cache_lookup(const USBContext *ctx, const USBDeviceInfo *info) {
+    for (size_t i = 0; i < ctx->endpoint_cache_len; i++) {
+        const USBEndpointCacheEntry *entry = &ctx->endpoint_cache[i];
+        if (entry->vendor_id == info->vendor_id && entry->product_id == info->product_id &&
+            entry->bcd_device == info->bcd_device) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void usb_endpoint_cache_insert(USBContext *ctx, const USBEndpointCacheEntry *entry) {
+    // There are only a handful of models, so simply stop caching once full
+    if (ctx->endpoint_cache_len >= USB_ENDPOINT_CACHE_SIZE) {
+        return;
+    }
+    ctx->endpoint_cache[ctx->endpoint_cache_len] = *entry;
+    ctx->endpoint_cache_len++;
+}
+
+// Look for a HID interface with an interrupt endpoint in each direction carrying U2FHID-sized reports.
+// The key's other HID interface (the keyboard used for typing HOTP codes) only has a small IN endpoint.
+static bool usb_parse_fido_interface(const struct libusb_interface_descriptor *iface, USBEndpointCacheEntry *entry) {
+    if (iface->bInterfaceClass != LIBUSB_CLASS_HID) {
         return false;
     }
-    return true;
+    bool have_in = false;
+    bool have_out = false;
+    for (uint8_t i = 0; i < iface->bNumEndpoints; i++) {
+        const struct libusb_endpoint_descriptor *ep = &iface->endpoint[i];
+        if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_INTERRUPT ||
+            ep->wMaxPacketSize != USB_FIDO_REPORT_SIZE) {
+            continue;
+        }
+        if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+            entry->in_endpoint = ep->bEndpointAddress;
+            have_in = true;
+        } else {
+            entry->out_endpoint = ep->bEndpointAddress;
+            have_out = true;
+        }
+    }
+    entry->iface_num = iface->bInterfaceNumber;
+    return have_in && have_out;
 }
 
-static int usb_find_and_init_device(libusb_device_handle **handle) {
-    // discover devices
+static int usb_discover_endpoints(USBContext *ctx, const USBDeviceInfo *info, USBEndpointCacheEntry *result) {
+    const USBEndpointCacheEntry *cached = usb_endpoint_cache_lookup(ctx, info);
+    if (cached != NULL) {
+        *result = *cached;
+        return 0;
+    }
+
+    struct libusb_config_descriptor *config = NULL;
+    int err = libusb_get_active_config_descriptor(info->device, &config);
+    if (err != 0) {
+        log_error_libusb("Failed to get configuration descriptor", err);
+        return -1;
+    }
+    USBEndpointCacheEntry entry = {
+        .vendor_id = info->vendor_id, .product_id = info->product_id, .bcd_device = info->bcd_device};
+    bool found = false;
+    for (uint8_t i = 0; i < config->bNumInterfaces && !found; i++) {
+        const struct libusb_interface *iface = &config->interface[i];
+        if (iface->num_altsetting > 0) {
+            found = usb_parse_fido_interface(&iface->altsetting[0], &entry);
+        }
+    }
+    libusb_free_config_descriptor(config);
+    if (!found) {
+        log_error("Failed to open device: Could not find the FIDO interface");
+        return -1;
+    }
+
+    log_debug("Discovered FIDO interface");
+    usb_endpoint_cache_insert(ctx, &entry);
+    *result = entry;
+    return 0;
+}
+
+static void usb_fill_device_info(libusb_device *dev, const struct libusb_device_descriptor *desc, USBDeviceInfo *info) {
+    info->bus = libusb_get_bus_number(dev);
+    info->address = libusb_get_device_address(dev);
+    int depth = libusb_get_port_numbers(dev, info->port_path, USB_MAX_PORT_DEPTH);
+    info->port_path_len = depth < 0 ? 0 : (uint8_t)depth;
+    info->vendor_id = desc->idVendor;
+    info->product_id = desc->idProduct;
+    info->bcd_device = desc->bcdDevice;
+    info->device = libusb_ref_device(dev);
+}
+
+int usb_enumerate(USBContext *ctx, USBDeviceInfo **devices, size_t *count) {
+    *devices = NULL;
+    *count = 0;
+
     libusb_device **list;
-    ssize_t cnt = libusb_get_device_list(NULL, &list);
-    ssize_t i = 0;
-    int err = 0;
+    ssize_t cnt = libusb_get_device_list(ctx->ctx, &list);
     if (cnt < 0) {
         log_error("Could not get device list from libusb");
         return -1;
     }
 
-    libusb_device *found = NULL;
-    for (i = 0; i < cnt; i++) {
-        libusb_device *device = list[i];
-        // TODO: handle multiple devices being present (cmd arg or menu to choose)
-        if (is_wanted_device(device)) {
-            if (found != NULL) {
-                log_error("More than one eligible device detected! Please unplug all but one and try again");
-                return -1;
-            }
+    USBDeviceInfo *found = (USBDeviceInfo *)calloc((size_t)cnt + 1, sizeof(USBDeviceInfo));
+    if (found == NULL) {
+        log_error("Failed to enumerate devices: Out of memory");
+        libusb_free_device_list(list, true);
+        return -1;
+    }
+    size_t n = 0;
+    for (ssize_t i = 0; i < cnt; i++) {
+        struct libusb_device_descriptor desc = {0};
+        if (is_wanted_device(list[i], &desc)) {
             log_debug("Found device");
-            found = device;
+            usb_fill_device_info(list[i], &desc, &found[n]);
+            n++;
         }
     }
+    libusb_free_device_list(list, true);
 
-    if (found != NULL) {
-        // Open device
-        err = libusb_open(found, handle);
-        if (err != 0) {
-            log_error_libusb("Failed to open device", err);
-            return -1;
-        }
+    *devices = found;
+    *count = n;
+    return 0;
+}
 
-        // Try to detach kernel driver
-        err = libusb_set_auto_detach_kernel_driver(*handle, true);
-        if (err != 0) {
-            log_debug("Failed to detach kernel driver. On platforms where this is unsupported that's not a problem.");
+void usb_free_device_list(USBDeviceInfo *devices, const size_t count) {
+    if (devices == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        libusb_unref_device(devices[i].device);
+    }
+    free(devices);
+}
+
+void usb_format_port_path(const USBDeviceInfo *info, char *buf, const size_t buf_len) {
+    int written = snprintf(buf, buf_len, "%u", (unsigned int)info->bus);
+    for (size_t i = 0; i < info->port_path_len && written > 0 && (size_t)written < buf_len; i++) {
+        const char sep = i == 0 ? '-' : '.';
+        written += snprintf(buf + written, buf_len - (size_t)written, "%c%u", sep, (unsigned int)info->port_path[i]);
+    }
+}
+
+static int usb_open_hidraw(USBDevice *dev) {
+    dev->hidraw_fd = usb_hidraw_open(&dev->info, dev->iface_num);
+    if (dev->hidraw_fd < 0) {
+        return -1;
+    }
+    if (usb_async_pool_init(&dev->pool) != 0) {
+        usb_hidraw_close(dev->hidraw_fd);
+        dev->hidraw_fd = -1;
+        return -1;
+    }
+    dev->backend = USB_BACKEND_HIDRAW;
+    USBContext *ctx = dev->ctx;
+    dev->next_hidraw = ctx->hidraw_devices;
+    ctx->hidraw_devices = dev;
+    if (ctx->pollfd_added != NULL) {
+        ctx->pollfd_added(dev->hidraw_fd, USB_HIDRAW_POLL_EVENTS, ctx->pollfd_user_data);
+    }
+    return 0;
+}
+
+static void usb_close_hidraw(USBDevice *dev) {
+    USBContext *ctx = dev->ctx;
+    for (USBDevice **link = &ctx->hidraw_devices; *link != NULL; link = &(*link)->next_hidraw) {
+        if (*link == dev) {
+            *link = dev->next_hidraw;
+            break;
         }
+    }
+    if (ctx->pollfd_removed != NULL) {
+        ctx->pollfd_removed(dev->hidraw_fd, ctx->pollfd_user_data);
+    }
+    usb_hidraw_close(dev->hidraw_fd);
+}
 
-        // Claim FIDO interface from kernel
-        err = libusb_claim_interface(*handle, HYPERHOTP_IFACE_NUM);
-        if (err != 0) {
-            log_error_libusb("Failed to claim device from kernel", err);
-            return -1;
+int usb_open(USBContext *ctx, const USBDeviceInfo *info, USBDevice **dev) {
+    *dev = NULL;
+    USBDevice *d = (USBDevice *)calloc(1, sizeof(USBDevice));
+    if (d == NULL) {
+        log_error("Failed to open device: Out of memory");
+        return -1;
+    }
+    d->ctx = ctx;
+    d->info = *info;
+    libusb_ref_device(d->info.device);
+
+    USBEndpointCacheEntry endpoints = {0};
+    int err = usb_discover_endpoints(ctx, info, &endpoints);
+    if (err != 0) {
+        goto fail;
+    }
+    d->iface_num = endpoints.iface_num;
+    d->in_endpoint = endpoints.in_endpoint;
+    d->out_endpoint = endpoints.out_endpoint;
+    d->hidraw_fd = -1;
+
+    if (ctx->backend != USB_BACKEND_LIBUSB) {
+        err = usb_open_hidraw(d);
+        if (err == 0) {
+            *dev = d;
+            return 0;
+        }
+        if (ctx->backend == USB_BACKEND_HIDRAW) {
+            goto fail;
         }
+        log_debug("Falling back to libusb");
+    }
+    d->backend = USB_BACKEND_LIBUSB;
 
-        libusb_free_device_list(list, true);
-        return 0;
-    } else {
-        libusb_free_device_list(list, true);
+    // Open device
+    err = libusb_open(d->info.device, &d->handle);
+    if (err != 0) {
+        log_error_libusb("Failed to open device", err);
+        goto fail;
+    }
+
+    // Try to detach kernel driver
+    err = libusb_set_auto_detach_kernel_driver(d->handle, true);
+    if (err != 0) {
+        log_debug("Failed to detach kernel driver. On platforms where this is unsupported that's not a problem.");
+    }
+
+    // Claim FIDO interface from kernel
+    err = libusb_claim_interface(d->handle, d->iface_num);
+    if (err != 0) {
+        log_error_libusb("Failed to claim device from kernel", err);
+        libusb_close(d->handle);
+        goto fail;
+    }
+
+    err = usb_async_pool_init(&d->pool);
+    if (err != 0) {
+        libusb_release_interface(d->handle, d->iface_num);
+        libusb_close(d->handle);
+        goto fail;
+    }
+
+    *dev = d;
+    return 0;
+
+fail:
+    libusb_unref_device(d->info.device);
+    free(d);
+    return -1;
+}
+
+int usb_init(USBContext *ctx, USBDevice **dev) {
+    USBDeviceInfo *devices = NULL;
+    size_t count = 0;
+    int err = usb_enumerate(ctx, &devices, &count);
+    if (err != 0) {
+        return -1;
+    }
+    if (count == 0) {
+        usb_free_device_list(devices, count);
         log_error("Device could not be found, perhaps it's not plugged in?");
         return -1;
     }
+    if (count > 1) {
+        usb_free_device_list(devices, count);
+        log_error("More than one eligible device detected! Please unplug all but one and try again");
+        return -1;
+    }
+    err = usb_open(ctx, &devices[0], dev);
+    usb_free_device_list(devices, count);
+    return err;
 }
 
-int usb_init(libusb_device_handle **handle) {
-    int err = libusb_init(NULL);
-    if (err != 0) {
-        log_error_libusb("Failed to init libusb", err);
+// Called by libusb from within the event loop.
+// Opening devices from here isn't safe on all platforms, so the event is merely recorded for usb_hotplug_poll().
+static int LIBUSB_CALL usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event,
+                                      void *user_data) {
+    (void)ctx;
+    USBHotplug *hotplug = (USBHotplug *)user_data;
+    USBHotplugEvent *ev = (USBHotplugEvent *)calloc(1, sizeof(USBHotplugEvent));
+    if (ev == NULL) {
+        log_error("Failed to record hotplug event: Out of memory");
+        return 0;
+    }
+    ev->device = libusb_ref_device(device);
+    ev->arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+    if (hotplug->pending_tail != NULL) {
+        hotplug->pending_tail->next = ev;
+    } else {
+        hotplug->pending_head = ev;
+    }
+    hotplug->pending_tail = ev;
+    return 0;
+}
+
+int usb_hotplug_start(USBContext *ctx, USBHotplug **hotplug, USBArrivedCallback arrived, USBLeftCallback left,
+                      void *user_data) {
+    *hotplug = NULL;
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        log_error("Failed to watch for devices: Hotplug is not supported on this platform");
+        return -1;
+    }
+    USBHotplug *h = (USBHotplug *)calloc(1, sizeof(USBHotplug));
+    if (h == NULL) {
+        log_error("Failed to watch for devices: Out of memory");
         return -1;
     }
+    h->ctx = ctx;
+    h->arrived = arrived;
+    h->left = left;
+    h->user_data = user_data;
 
-    // Configure debugging
-#ifdef DEBUG
-    err = libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
+    // Already connected devices are reported as arrivals as well
+    for (size_t i = 0; i < USB_NUM_SUPPORTED_IDS; i++) {
+        int err = libusb_hotplug_register_callback(
+            ctx->ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+            USB_SUPPORTED_IDS[i].vendor_id, USB_SUPPORTED_IDS[i].product_id, LIBUSB_HOTPLUG_MATCH_ANY, usb_hotplug_cb,
+            h, &h->callback_handles[i]);
+        if (err != 0) {
+            log_error_libusb("Failed to register hotplug callback", err);
+            usb_hotplug_stop(h);
+            return -1;
+        }
+        h->num_callback_handles++;
+    }
+    *hotplug = h;
+    return 0;
+}
+
+static void usb_hotplug_handle_arrival(USBHotplug *hotplug, libusb_device *device) {
+    struct libusb_device_descriptor desc = {0};
+    if (!is_wanted_device(device, &desc)) {
+        return;
+    }
+    USBDeviceInfo info = {0};
+    usb_fill_device_info(device, &desc, &info);
+    USBDevice *dev = NULL;
+    int err = usb_open(hotplug->ctx, &info, &dev);
+    libusb_unref_device(info.device);
     if (err != 0) {
-        log_error_libusb("Failed to set libusb log level", err);
-        return -1;
+        // Keep watching, the error message stays available through the log module
+        return;
     }
-    libusb_set_log_cb(NULL, log_libusb_callback, LIBUSB_LOG_CB_GLOBAL);
-#endif
 
-    // Find device
-    err = usb_find_and_init_device(handle);
+    USBHotplugDevice *tracked = (USBHotplugDevice *)calloc(1, sizeof(USBHotplugDevice));
+    if (tracked == NULL) {
+        log_error("Failed to track hotplugged device: Out of memory");
+        usb_cleanup(dev);
+        return;
+    }
+    tracked->dev = dev;
+    tracked->next = hotplug->devices;
+    hotplug->devices = tracked;
+    if (hotplug->arrived != NULL) {
+        hotplug->arrived(dev, hotplug->user_data);
+    }
+}
+
+static void usb_hotplug_handle_departure(USBHotplug *hotplug, libusb_device *device) {
+    USBHotplugDevice **link = &hotplug->devices;
+    while (*link != NULL) {
+        USBHotplugDevice *tracked = *link;
+        if (tracked->dev->info.device != device) {
+            link = &tracked->next;
+            continue;
+        }
+        *link = tracked->next;
+        if (hotplug->left != NULL) {
+            hotplug->left(tracked->dev, hotplug->user_data);
+        }
+        usb_cleanup(tracked->dev);
+        free(tracked);
+        return;
+    }
+}
+
+int usb_hotplug_poll(USBHotplug *hotplug, const int timeout_ms) {
+    int err = usb_async_handle_events(hotplug->ctx->ctx, timeout_ms);
     if (err != 0) {
         return -1;
     }
+
+    USBHotplugEvent *ev = hotplug->pending_head;
+    hotplug->pending_head = NULL;
+    hotplug->pending_tail = NULL;
+    while (ev != NULL) {
+        USBHotplugEvent *next = ev->next;
+        if (ev->arrived) {
+            usb_hotplug_handle_arrival(hotplug, ev->device);
+        } else {
+            usb_hotplug_handle_departure(hotplug, ev->device);
+        }
+        libusb_unref_device(ev->device);
+        free(ev);
+        ev = next;
+    }
     return 0;
 }
 
-int usb_send(libusb_device_handle *handle, const uint8_t *buf, const uint8_t buf_len) {
-    log_sent(buf, buf_len);
-    int transferred = 0;
-    // TODO: Timeout
-    int err = libusb_interrupt_transfer(handle, HYPERHOTP_OUT_ENDPOINT, (unsigned char *)buf, buf_len, &transferred,
-                                        0);  // NOLINT (This is a send, so libusb doesn't write)
-    if (err != 0) {
-        log_error_libusb("Failed to perform interrupt transfer", err);
+void usb_hotplug_stop(USBHotplug *hotplug) {
+    if (hotplug == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < hotplug->num_callback_handles; i++) {
+        libusb_hotplug_deregister_callback(hotplug->ctx->ctx, hotplug->callback_handles[i]);
+    }
+    for (USBHotplugEvent *ev = hotplug->pending_head; ev != NULL;) {
+        USBHotplugEvent *next = ev->next;
+        libusb_unref_device(ev->device);
+        free(ev);
+        ev = next;
+    }
+    for (USBHotplugDevice *tracked = hotplug->devices; tracked != NULL;) {
+        USBHotplugDevice *next = tracked->next;
+        usb_cleanup(tracked->dev);
+        free(tracked);
+        tracked = next;
+    }
+    free(hotplug);
+}
+
+USBTransfer *usb_acquire_transfer(USBDevice *dev) { return usb_async_pool_acquire(&dev->pool); }
+
+void usb_release_transfer(USBTransfer *transfer) { usb_async_pool_release(transfer); }
+
+// Translate the time left until the deadline into a libusb timeout, where 0 means "no timeout".
+static unsigned int usb_libusb_timeout(const Deadline *deadline) {
+    const uint64_t remaining = deadline_remaining_ms(deadline);
+    if (remaining == DEADLINE_INFINITE) {
+        return 0;
+    }
+    if (remaining == 0) {
+        return 1;
+    }
+    if (remaining > UINT_MAX) {
+        return UINT_MAX;
+    }
+    return (unsigned int)remaining;
+}
+
+// Fail early if there's no time left to even start a transfer.
+static int usb_check_deadline(const Deadline *deadline) {
+    if (deadline_is_cancelled(deadline)) {
+        log_error("Failed to perform interrupt transfer: Operation was cancelled");
         return -1;
     }
-    // TODO: Build reliable transmission abstraction if needed
-    if (transferred != buf_len) {
-        log_error("Failed to perform interrupt transfer: Not all data got sent");
+    if (deadline_expired(deadline)) {
+        log_error("Failed to perform interrupt transfer: Operation timed out");
         return -1;
     }
     return 0;
 }
 
-int usb_recv(libusb_device_handle *handle, uint8_t *buf, const uint8_t buf_len) {
-    int transferred = 0;
-    // TODO: Timeout
-    int err = libusb_interrupt_transfer(handle, HYPERHOTP_IN_ENDPOINT, buf, buf_len, &transferred, 0);
+// hidraw sends are done on the spot, receives are completed by usb_hidraw_handle_reads().
+static void usb_hidraw_submit(USBDevice *dev, USBTransfer *transfer, const unsigned char endpoint, uint8_t *buf,
+                              const uint8_t buf_len, const Deadline *deadline, USBCompletionQueue *queue,
+                              USBTransferCallback callback, void *user_data) {
+    const unsigned int timeout_ms = usb_libusb_timeout(deadline);
+    transfer->queue = queue;
+    transfer->callback = callback;
+    transfer->user_data = user_data;
+    transfer->completed = 0;
+    transfer->next = NULL;
+    transfer->fd = dev->hidraw_fd;
+    transfer->expires_at_ms = timeout_ms == 0 ? DEADLINE_INFINITE : deadline_now_ms() + timeout_ms;
+    // libusb's transfer merely records the outcome, so that it's checked the same way for both backends
+    libusb_fill_interrupt_transfer(transfer->xfer, NULL, endpoint, buf, buf_len, NULL, transfer, timeout_ms);
+    if (queue != NULL) {
+        queue->in_flight++;
+    }
+
+    if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+        const int sent = usb_hidraw_write(dev->hidraw_fd, buf, buf_len);
+        transfer->xfer->status = sent < 0 ? usb_hidraw_status(sent) : LIBUSB_TRANSFER_COMPLETED;
+        transfer->xfer->actual_length = sent < 0 ? 0 : sent;
+        usb_async_complete(transfer);
+        return;
+    }
+    USBTransfer **link = &dev->ctx->hidraw_reads;
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+    *link = transfer;
+}
+
+static int usb_submit_attempt(USBDevice *dev, USBTransfer *transfer, const unsigned char endpoint, uint8_t *buf,
+                              const uint8_t buf_len, const Deadline *deadline, USBCompletionQueue *queue,
+                              USBTransferCallback callback, void *user_data) {
+    if (usb_check_deadline(deadline) != 0) {
+        return -1;
+    }
+    if (dev->backend == USB_BACKEND_HIDRAW) {
+        usb_hidraw_submit(dev, transfer, endpoint, buf, buf_len, deadline, queue, callback, user_data);
+        return 0;
+    }
+    return usb_async_submit(queue, transfer, dev->handle, endpoint, buf, buf_len, usb_libusb_timeout(deadline),
+                            callback, user_data);
+}
+
+static int usb_submit(USBDevice *dev, USBTransfer *transfer, const unsigned char endpoint, uint8_t *buf,
+                      const uint8_t buf_len, const Deadline *deadline, USBCompletionQueue *queue,
+                      USBTransferCallback callback, void *user_data) {
+    transfer->attempts = 1;
+    return usb_submit_attempt(dev, transfer, endpoint, buf, buf_len, deadline, queue, callback, user_data);
+}
+
+// Submit the same data again, to the same queue and callback.
+static int usb_resubmit(USBDevice *dev, USBTransfer *transfer, const Deadline *deadline) {
+    struct libusb_transfer *xfer = transfer->xfer;
+    transfer->attempts++;
+    return usb_submit_attempt(dev, transfer, xfer->endpoint, xfer->buffer, (uint8_t)xfer->length, deadline,
+                              transfer->queue, transfer->callback, transfer->user_data);
+}
+
+int usb_submit_send(USBDevice *dev, USBTransfer *transfer, const uint8_t *buf, const uint8_t buf_len,
+                    const Deadline *deadline, USBTransferCallback callback, void *user_data) {
+    log_sent(buf, buf_len);
+    return usb_submit(dev, transfer, dev->out_endpoint, (uint8_t *)buf, buf_len, deadline, &dev->ctx->completions,
+                      callback, user_data);  // NOLINT (This is a send, so libusb doesn't write)
+}
+
+int usb_submit_recv(USBDevice *dev, USBTransfer *transfer, uint8_t *buf, const uint8_t buf_len,
+                    const Deadline *deadline, USBTransferCallback callback, void *user_data) {
+    return usb_submit(dev, transfer, dev->in_endpoint, buf, buf_len, deadline, &dev->ctx->completions, callback,
+                      user_data);
+}
+
+int usb_cancel_transfer(USBDevice *dev, USBTransfer *transfer) {
+    if (dev->backend != USB_BACKEND_HIDRAW) {
+        return usb_async_cancel(transfer);
+    }
+    if (!transfer->completed) {
+        usb_hidraw_finish(dev->ctx, transfer, LIBUSB_TRANSFER_CANCELLED, 0);
+    }
+    return 0;
+}
+
+// Bring the device back into a usable state after it has been misbehaving.
+// Afterwards it has forgotten all U2FHID channels.
+static void usb_reset(USBDevice *dev) {
+    log_debug("Resetting device");
+    const int err = libusb_reset_device(dev->handle);
     if (err != 0) {
+        // Most likely the device re-enumerated, in which case this handle is of no use anymore
+        log_debug("Failed to reset device");
+        return;
+    }
+    dev->resets++;
+}
+
+// Get the device ready for retrying a failed transfer (err is 0 for a short write).
+// Returns true if the transfer should be retried.
+static bool usb_recover(USBDevice *dev, const USBTransfer *transfer, const int err, const Deadline *deadline) {
+    if (transfer->attempts >= USB_MAX_TRANSFER_ATTEMPTS || deadline_expired(deadline)) {
+        return false;
+    }
+    switch (err) {
+        case 0:
+            log_debug("Not all data got sent, retrying");
+            return true;
+        case LIBUSB_ERROR_PIPE:
+            if (dev->backend == USB_BACKEND_HIDRAW) {
+                // The kernel's HID driver takes care of halted endpoints
+                return true;
+            }
+            log_debug("Endpoint halted, clearing");
+            const int clear_err = libusb_clear_halt(dev->handle, transfer->xfer->endpoint);
+            if (clear_err != 0) {
+                log_debug("Failed to clear halted endpoint");
+                return false;
+            }
+            return true;
+        case LIBUSB_ERROR_IO:
+        case LIBUSB_ERROR_OVERFLOW:
+            if (dev->backend == USB_BACKEND_HIDRAW) {
+                return true;
+            }
+            // Whatever the device was doing is lost, so there's nothing to retry here
+            usb_reset(dev);
+            return false;
+        default:
+            return false;
+    }
+}
+
+int usb_check_transfer(USBDevice *dev, USBTransfer *transfer, const Deadline *deadline) {
+    const struct libusb_transfer *xfer = transfer->xfer;
+    const bool is_send = (xfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
+    const int err = usb_async_result(transfer);
+    const bool is_short = err == 0 && xfer->actual_length != xfer->length;
+    if (err == 0 && !is_short) {
+        if (!is_send) {
+            log_received(xfer->buffer, (size_t)xfer->actual_length);
+        }
+        return 0;
+    }
+
+    // A short receive can't be retried, as the rest of the report is gone
+    if ((err != 0 || is_send) && usb_recover(dev, transfer, err, deadline)) {
+        if (usb_resubmit(dev, transfer, deadline) != 0) {
+            return -1;
+        }
+        return USB_TRANSFER_RETRYING;
+    }
+
+    if (is_short) {
+        if (is_send) {
+            log_error("Failed to perform interrupt transfer: Not all data got sent");
+        } else {
+            log_error("Failed to perform interrupt transfer: Not all data got received");
+        }
+    } else if (deadline_is_cancelled(deadline)) {
+        log_error("Failed to perform interrupt transfer: Operation was cancelled");
+    } else if (err == LIBUSB_ERROR_TIMEOUT || (err == LIBUSB_ERROR_INTERRUPTED && deadline_expired(deadline))) {
+        log_error("Failed to perform interrupt transfer: Operation timed out");
+    } else {
         log_error_libusb("Failed to perform interrupt transfer", err);
-        return -1;
     }
-    // TODO: Build reliable transmission abstraction if needed
-    if (transferred != buf_len) {
-        log_error("Failed to perform interrupt transfer: Not all data got received");
+    return -1;
+}
+
+// Counterpart of usb_async_wait() for hidraw.
+static int usb_hidraw_wait(USBDevice *dev, USBTransfer *transfer, const Deadline *deadline) {
+    while (!transfer->completed) {
+        if (deadline_expired(deadline)) {
+            return usb_cancel_transfer(dev, transfer);
+        }
+        uint64_t slice_ms = deadline_remaining_ms(deadline);
+        if (slice_ms > USB_ASYNC_POLL_INTERVAL_MS) {
+            slice_ms = USB_ASYNC_POLL_INTERVAL_MS;
+        }
+        // The wait also ends when one of libusb's file descriptors is ready (e.g. a hotplug event), which has to be
+        // handled here, or the next wait returns right away again
+        if (usb_hidraw_handle_reads(dev->ctx, (int)slice_ms) != 0 || usb_async_handle_events(dev->ctx->ctx, 0) != 0) {
+            usb_cancel_transfer(dev, transfer);
+            return -1;
+        }
     }
-    log_received(buf, buf_len);
     return 0;
 }
 
-int usb_cleanup(libusb_device_handle *handle) {
-    int err = libusb_release_interface(handle, HYPERHOTP_IFACE_NUM);
+// Submit a single transfer and block until it's done.
+static int usb_transfer_sync(USBDevice *dev, const unsigned char endpoint, uint8_t *buf, const uint8_t buf_len,
+                             const Deadline *deadline) {
+    USBTransfer *transfer = usb_acquire_transfer(dev);
+    if (transfer == NULL) {
+        return -1;
+    }
+    int err = usb_submit(dev, transfer, endpoint, buf, buf_len, deadline, NULL, NULL, NULL);
     if (err != 0) {
-        log_error_libusb("Failed to release device interface", err);
+        usb_release_transfer(transfer);
         return -1;
     }
-    libusb_close(handle);
-    libusb_exit(NULL);
-    return 0;
+    do {
+        if (dev->backend == USB_BACKEND_HIDRAW) {
+            err = usb_hidraw_wait(dev, transfer, deadline);
+        } else {
+            err = usb_async_wait(dev->ctx->ctx, transfer, deadline);
+        }
+        if (err == 0) {
+            err = usb_check_transfer(dev, transfer, deadline);
+        }
+    } while (err == USB_TRANSFER_RETRYING);
+    usb_release_transfer(transfer);
+    return err;
+}
+
+int usb_send(USBDevice *dev, const uint8_t *buf, const uint8_t buf_len, const Deadline *deadline) {
+    log_sent(buf, buf_len);
+    return usb_transfer_sync(dev, dev->out_endpoint, (uint8_t *)buf, buf_len,
+                             deadline);  // NOLINT (This is a send, so libusb doesn't write)
+}
+
+int usb_recv(USBDevice *dev, uint8_t *buf, const uint8_t buf_len, const Deadline *deadline) {
+    return usb_transfer_sync(dev, dev->in_endpoint, buf, buf_len, deadline);
+}
+
+int usb_cleanup(USBDevice *dev) {
+    if (dev->backend == USB_BACKEND_HIDRAW) {
+        usb_close_hidraw(dev);
+        usb_async_pool_cleanup(&dev->pool);
+        libusb_unref_device(dev->info.device);
+        free(dev);
+        return 0;
+    }
+    int result = 0;
+    int err = libusb_release_interface(dev->handle, dev->iface_num);
+    // If the device is already gone, there's nothing to release
+    if (err != 0 && err != LIBUSB_ERROR_NO_DEVICE) {
+        log_error_libusb("Failed to release device interface", err);
+        result = -1;
+    }
+    libusb_close(dev->handle);
+    usb_async_pool_cleanup(&dev->pool);
+    libusb_unref_device(dev->info.device);
+    free(dev);
+    return result;
 }
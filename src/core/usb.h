@@ -1,31 +1,306 @@
 #pragma once
 
 #include <libusb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deadline.h"
+#include "usb_async.h"
+
+// USB 3 allows for up to 7 tiers of hubs
+#define USB_MAX_PORT_DEPTH 7
+
+// Buffer size sufficient for usb_format_port_path()
+#define USB_PORT_PATH_STR_LEN 32
+
+// Number of VID/PID combinations recognized as hyperFIDO devices
+#define USB_NUM_SUPPORTED_IDS 2
+
+// Number of distinct device models whose interface layout is remembered
+#define USB_ENDPOINT_CACHE_SIZE 8
+
+// How often a transfer is submitted before giving up on recovering from short writes and stalls
+#define USB_MAX_TRANSFER_ATTEMPTS 3
+
+// Returned by usb_check_transfer() if the transfer was resubmitted after recovering from an error
+#define USB_TRANSFER_RETRYING 1
+
+// Location of the FIDO interface of a particular device model, as discovered from its descriptors.
+typedef struct {
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t bcd_device;
+    uint8_t iface_num;
+    uint8_t in_endpoint;
+    uint8_t out_endpoint;
+} USBEndpointCacheEntry;
+
+// How devices are talked to.
+typedef enum {
+    // hidraw where available, libusb otherwise
+    USB_BACKEND_AUTO,
+    // Detach the kernel's HID driver and claim the interface through libusb
+    USB_BACKEND_LIBUSB,
+    // Linux only, leaves the kernel's HID driver bound (see usb_hidraw.h)
+    USB_BACKEND_HIDRAW,
+} USBBackend;
+
+typedef void (*USBPollFdAddedCallback)(int fd, short events, void *user_data);
+typedef void (*USBPollFdRemovedCallback)(int fd, void *user_data);
+
+struct USBDevice;
+
+// Long-lived libusb state, shared by all devices and operations of a session.
+// Each context is independent, so several of them can coexist in one process.
+typedef struct {
+    libusb_context *ctx;
+    // Backend used by usb_open()
+    USBBackend backend;
+    // Opening another device of an already seen model skips descriptor parsing
+    USBEndpointCacheEntry endpoint_cache[USB_ENDPOINT_CACHE_SIZE];
+    size_t endpoint_cache_len;
+    // Completed transfers submitted through usb_submit_send()/usb_submit_recv()
+    USBCompletionQueue completions;
+    // Devices opened through hidraw, and receives waiting for one of them
+    struct USBDevice *hidraw_devices;
+    USBTransfer *hidraw_reads;
+    // Interrupts waiting for hidraw receives, see usb_context_wake(). -1 where hidraw isn't available.
+    int wake_fd;
+    USBPollFdAddedCallback pollfd_added;
+    USBPollFdRemovedCallback pollfd_removed;
+    void *pollfd_user_data;
+} USBContext;
+
+// A file descriptor to watch in an external event loop, events are as for poll().
+typedef struct {
+    int fd;
+    short events;
+} USBPollFd;
+
+// Describes an eligible device found on the bus.
+typedef struct {
+    uint8_t bus;
+    uint8_t address;
+    // Port numbers from the root hub down to the device
+    uint8_t port_path[USB_MAX_PORT_DEPTH];
+    uint8_t port_path_len;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t bcd_device;
+    libusb_device *device;
+} USBDeviceInfo;
+
+// An opened hyperFIDO device. Each one is independent of all others.
+typedef struct USBDevice {
+    USBContext *ctx;
+    USBBackend backend;
+    // Set for the libusb backend
+    libusb_device_handle *handle;
+    // Set for the hidraw backend
+    int hidraw_fd;
+    struct USBDevice *next_hidraw;
+    USBDeviceInfo info;
+    // FIDO interface, discovered from the descriptors
+    uint8_t iface_num;
+    uint8_t in_endpoint;
+    uint8_t out_endpoint;
+    // Transfers and frame buffers used for all I/O on this device
+    USBTransferPool pool;
+    // Incremented whenever the device had to be reset to recover from an error, which loses all U2FHID channels
+    uint32_t resets;
+} USBDevice;
+
+/*
+ * Initialize libusb. The context must outlive all devices opened through it.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_context_init(USBContext **ctx);
+
+void usb_context_cleanup(USBContext *ctx);
+
+// Choose how devices opened from now on are talked to. Defaults to USB_BACKEND_AUTO.
+void usb_context_set_backend(USBContext *ctx, const USBBackend backend);
+
+/*
+ * Handle pending USB events, waiting at most timeout_ms for one to arrive, then run the callbacks of all completed
+ * transfers. Pass 0 from an external event loop once one of the poll fds is ready, or its timeout has expired.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_context_handle_events(USBContext *ctx, const int timeout_ms);
+
+/*
+ * Make a usb_context_handle_events() running on another thread return early, e.g. because there's new work for it.
+ * Safe to call from any thread.
+ */
+void usb_context_wake(USBContext *ctx);
+
+/*
+ * Get the file descriptors an external event loop (e.g. epoll) has to watch on behalf of this context,
+ * including the hidraw nodes of open devices. The set can change, use usb_context_set_pollfd_notifiers() to keep track.
+ * The array must be freed with usb_context_free_pollfds().
+ * Returns 0 on success, -1 on failure (e.g. on Windows, where this isn't supported).
+ * Error message is obtainable through the log module.
+ */
+int usb_context_get_pollfds(USBContext *ctx, USBPollFd **fds, size_t *count);
+
+void usb_context_free_pollfds(USBPollFd *fds);
+
+// Register callbacks to be run whenever a file descriptor is added to or removed from the set to watch.
+void usb_context_set_pollfd_notifiers(USBContext *ctx, USBPollFdAddedCallback added, USBPollFdRemovedCallback removed,
+                                      void *user_data);
+
+/*
+ * Returns the maximum time in ms the external event loop may sleep before calling usb_context_handle_events(),
+ * or -1 if it may sleep until one of the file descriptors is ready.
+ */
+int usb_context_next_timeout(USBContext *ctx);
+
+/*
+ * Find all eligible devices on the bus.
+ * The list must be freed with usb_free_device_list(), even if it's empty.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_enumerate(USBContext *ctx, USBDeviceInfo **devices, size_t *count);
+
+void usb_free_device_list(USBDeviceInfo *devices, const size_t count);
+
+// Format the device's location as "<bus>-<port>.<port>...", like the Linux kernel does.
+void usb_format_port_path(const USBDeviceInfo *info, char *buf, const size_t buf_len);
+
+/*
+ * Open the given device through the context's backend. The device info may be freed afterwards.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_open(USBContext *ctx, const USBDeviceInfo *info, USBDevice **dev);
+
+/*
+ * Open the only eligible device. Fails if there's more than one.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_init(USBContext *ctx, USBDevice **dev);
+
+// Called once a newly plugged in device has been opened.
+// The device belongs to the hotplug watcher and stays valid until the left callback has returned.
+typedef void (*USBArrivedCallback)(USBDevice *dev, void *user_data);
+
+// Called when a device previously passed to the arrived callback has been unplugged. It's closed afterwards.
+typedef void (*USBLeftCallback)(USBDevice *dev, void *user_data);
+
+typedef struct USBHotplugEvent {
+    libusb_device *device;
+    bool arrived;
+    struct USBHotplugEvent *next;
+} USBHotplugEvent;
+
+typedef struct USBHotplugDevice {
+    USBDevice *dev;
+    struct USBHotplugDevice *next;
+} USBHotplugDevice;
+
+// Watches the bus for eligible devices being plugged in and unplugged.
+typedef struct {
+    USBContext *ctx;
+    libusb_hotplug_callback_handle callback_handles[USB_NUM_SUPPORTED_IDS];
+    size_t num_callback_handles;
+    // Events received from libusb, but not handled yet
+    USBHotplugEvent *pending_head;
+    USBHotplugEvent *pending_tail;
+    // Devices opened by the watcher
+    USBHotplugDevice *devices;
+    USBArrivedCallback arrived;
+    USBLeftCallback left;
+    void *user_data;
+} USBHotplug;
+
+/*
+ * Start watching for devices. Devices which are already connected are reported as arrivals on the first poll.
+ * Returns 0 on success, -1 on failure (e.g. if the platform doesn't support hotplug).
+ * Error message is obtainable through the log module.
+ */
+int usb_hotplug_start(USBContext *ctx, USBHotplug **hotplug, USBArrivedCallback arrived, USBLeftCallback left,
+                      void *user_data);
+
+/*
+ * Wait at most timeout_ms for devices to arrive or leave, then open/close them and run the callbacks.
+ * Devices which fail to open are skipped.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_hotplug_poll(USBHotplug *hotplug, const int timeout_ms);
+
+// Stop watching and close all devices opened by the watcher.
+void usb_hotplug_stop(USBHotplug *hotplug);
+
+/*
+ * Release and close the device.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_cleanup(USBDevice *dev);
+
+/*
+ * Take a transfer with a zeroed USB_FRAME_SIZE frame buffer out of the device's pool.
+ * Hand it back with usb_release_transfer() once it has completed.
+ * Returns NULL on failure.
+ * Error message is obtainable through the log module.
+ */
+USBTransfer *usb_acquire_transfer(USBDevice *dev);
+
+void usb_release_transfer(USBTransfer *transfer);
 
 /*
- * Initialize the hyperFIDO usb device's libusb handle.
+ * Start sending the given data to the device without waiting for it to arrive.
+ * The callback is run from usb_context_handle_events() once the transfer has completed, after which
+ * usb_check_transfer() tells whether it succeeded. buf must stay valid until then.
+ * The deadline bounds the transfer and must stay valid until it has completed.
  * Returns 0 on success, -1 on failure.
  * Error message is obtainable through the log module.
  */
-int usb_init(libusb_device_handle **handle);
+int usb_submit_send(USBDevice *dev, USBTransfer *transfer, const uint8_t *buf, const uint8_t buf_len,
+                    const Deadline *deadline, USBTransferCallback callback, void *user_data);
 
 /*
- * Release the hyperFIDO usb device's libusb handle.
+ * Same as usb_submit_send(), but receives data from the device.
+ */
+int usb_submit_recv(USBDevice *dev, USBTransfer *transfer, uint8_t *buf, const uint8_t buf_len,
+                    const Deadline *deadline, USBTransferCallback callback, void *user_data);
+
+/*
+ * Abort a transfer started through usb_submit_send()/usb_submit_recv(). It still completes, with a failed status.
  * Returns 0 on success, -1 on failure.
  * Error message is obtainable through the log module.
  */
-int usb_cleanup(libusb_device_handle *handle);
+int usb_cancel_transfer(USBDevice *dev, USBTransfer *transfer);
+
+/*
+ * Check whether a completed transfer succeeded, and try to recover if it didn't:
+ * Short writes are retried, halted endpoints are cleared and retried, and other I/O errors reset the device.
+ * A reset can't be recovered from on this level, as it loses the U2FHID channel, so the transfer fails with
+ * dev->resets incremented and the caller has to re-sync the channel.
+ * Returns 0 on success, -1 on failure, or USB_TRANSFER_RETRYING if the transfer was resubmitted, in which case it
+ * completes (and has to be checked) again later.
+ * Error message is obtainable through the log module.
+ */
+int usb_check_transfer(USBDevice *dev, USBTransfer *transfer, const Deadline *deadline);
 
 /*
- * Send the given data to device as an interrupt transfer.
+ * Send the given data to device as an interrupt transfer, recovering from errors like usb_check_transfer() does.
+ * Gives up once the deadline expires or is cancelled (NULL waits forever).
  * Returns 0 on success, -1 on failure.
  * Error message is obtainable through the log module.
  */
-int usb_send(libusb_device_handle *handle, const uint8_t *buf, const uint8_t buf_len);
+int usb_send(USBDevice *dev, const uint8_t *buf, const uint8_t buf_len, const Deadline *deadline);
 
 /*
- * Receive data from the device as an interrupt transfer.
+ * Receive data from the device as an interrupt transfer, recovering from errors like usb_check_transfer() does.
+ * Gives up once the deadline expires or is cancelled (NULL waits forever).
  * Returns 0 on success, -1 on failure.
  * Error message is obtainable through the log module.
  */
-int usb_recv(libusb_device_handle *handle, uint8_t *buf, const uint8_t buf_len);
+int usb_recv(USBDevice *dev, uint8_t *buf, const uint8_t buf_len, const Deadline *deadline);
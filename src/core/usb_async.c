@@ -0,0 +1,263 @@
+#include "usb_async.h"
+
+#include <libusb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deadline.h"
+#include "log.h"
+
+static void usb_async_enqueue(USBCompletionQueue *queue, USBTransfer *transfer) {
+    transfer->next = NULL;
+    if (queue->tail != NULL) {
+        queue->tail->next = transfer;
+    } else {
+        queue->head = transfer;
+    }
+    queue->tail = transfer;
+}
+
+static void usb_async_unlink(USBCompletionQueue *queue, USBTransfer *transfer) {
+    USBTransfer *prev = NULL;
+    for (USBTransfer *curr = queue->head; curr != NULL; prev = curr, curr = curr->next) {
+        if (curr != transfer) {
+            continue;
+        }
+        if (prev != NULL) {
+            prev->next = curr->next;
+        } else {
+            queue->head = curr->next;
+        }
+        if (queue->tail == curr) {
+            queue->tail = prev;
+        }
+        curr->next = NULL;
+        return;
+    }
+}
+
+void usb_async_complete(USBTransfer *transfer) {
+    transfer->completed = 1;
+    if (transfer->queue != NULL) {
+        transfer->queue->in_flight--;
+        usb_async_enqueue(transfer->queue, transfer);
+    }
+}
+
+// Called by libusb from within the event loop.
+static void LIBUSB_CALL usb_async_transfer_cb(struct libusb_transfer *xfer) {
+    usb_async_complete((USBTransfer *)xfer->user_data);
+}
+
+void usb_async_queue_init(USBCompletionQueue *queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->in_flight = 0;
+}
+
+USBTransfer *usb_async_alloc(void) {
+    USBTransfer *transfer = (USBTransfer *)calloc(1, sizeof(USBTransfer));
+    if (transfer == NULL) {
+        log_error("Failed to allocate transfer: Out of memory");
+        return NULL;
+    }
+    transfer->xfer = libusb_alloc_transfer(0);
+    if (transfer->xfer == NULL) {
+        free(transfer);
+        log_error("Failed to allocate transfer: libusb_alloc_transfer() failed");
+        return NULL;
+    }
+    return transfer;
+}
+
+void usb_async_free(USBTransfer *transfer) {
+    if (transfer == NULL) {
+        return;
+    }
+    libusb_free_transfer(transfer->xfer);
+    free(transfer);
+}
+
+int usb_async_pool_init(USBTransferPool *pool) {
+    memset(pool, 0, sizeof(USBTransferPool));  // NOLINT (GCC doesn't support _s)
+    for (size_t i = 0; i < USB_TRANSFER_POOL_SIZE; i++) {
+        USBTransfer *transfer = &pool->transfers[i];
+        transfer->xfer = libusb_alloc_transfer(0);
+        if (transfer->xfer == NULL) {
+            usb_async_pool_cleanup(pool);
+            log_error("Failed to allocate transfer: libusb_alloc_transfer() failed");
+            return -1;
+        }
+        transfer->pool = pool;
+        transfer->frame = pool->frames[i];
+        transfer->next = pool->free_list;
+        pool->free_list = transfer;
+    }
+    return 0;
+}
+
+void usb_async_pool_cleanup(USBTransferPool *pool) {
+    for (size_t i = 0; i < USB_TRANSFER_POOL_SIZE; i++) {
+        if (pool->transfers[i].xfer != NULL) {
+            libusb_free_transfer(pool->transfers[i].xfer);
+            pool->transfers[i].xfer = NULL;
+        }
+    }
+    pool->free_list = NULL;
+}
+
+USBTransfer *usb_async_pool_acquire(USBTransferPool *pool) {
+    USBTransfer *transfer = pool->free_list;
+    if (transfer == NULL) {
+        log_error("Failed to allocate transfer: All transfers of the device are in use");
+        return NULL;
+    }
+    pool->free_list = transfer->next;
+    transfer->next = NULL;
+    transfer->queue = NULL;
+    transfer->callback = NULL;
+    transfer->user_data = NULL;
+    transfer->completed = 0;
+    memset(transfer->frame, 0, USB_FRAME_SIZE * sizeof(uint8_t));  // NOLINT (GCC doesn't support _s)
+    return transfer;
+}
+
+void usb_async_pool_release(USBTransfer *transfer) {
+    if (transfer == NULL) {
+        return;
+    }
+    USBTransferPool *pool = transfer->pool;
+    transfer->next = pool->free_list;
+    pool->free_list = transfer;
+}
+
+int usb_async_submit(USBCompletionQueue *queue, USBTransfer *transfer, libusb_device_handle *handle,
+                     const unsigned char endpoint, uint8_t *buf, const int buf_len, const unsigned int timeout_ms,
+                     USBTransferCallback callback, void *user_data) {
+    transfer->queue = queue;
+    transfer->callback = callback;
+    transfer->user_data = user_data;
+    transfer->completed = 0;
+    transfer->next = NULL;
+    libusb_fill_interrupt_transfer(transfer->xfer, handle, endpoint, buf, buf_len, usb_async_transfer_cb, transfer,
+                                   timeout_ms);
+
+    int err = libusb_submit_transfer(transfer->xfer);
+    if (err != 0) {
+        log_error_libusb("Failed to submit transfer", err);
+        return -1;
+    }
+    if (queue != NULL) {
+        queue->in_flight++;
+    }
+    return 0;
+}
+
+int usb_async_cancel(USBTransfer *transfer) {
+    int err = libusb_cancel_transfer(transfer->xfer);
+    // Already completed or cancelled, nothing to do
+    if (err == LIBUSB_ERROR_NOT_FOUND) {
+        return 0;
+    }
+    if (err != 0) {
+        log_error_libusb("Failed to cancel transfer", err);
+        return -1;
+    }
+    return 0;
+}
+
+int usb_async_handle_events(libusb_context *ctx, const int timeout_ms) {
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    int err = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+        log_error_libusb("Failed to handle USB events", err);
+        return -1;
+    }
+    return 0;
+}
+
+USBTransfer *usb_async_pop(USBCompletionQueue *queue) {
+    USBTransfer *transfer = queue->head;
+    if (transfer == NULL) {
+        return NULL;
+    }
+    queue->head = transfer->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    transfer->next = NULL;
+    return transfer;
+}
+
+size_t usb_async_dispatch(USBCompletionQueue *queue) {
+    size_t n = 0;
+    USBTransfer *transfer = NULL;
+    while ((transfer = usb_async_pop(queue)) != NULL) {
+        if (transfer->callback != NULL) {
+            transfer->callback(transfer);
+        }
+        n++;
+    }
+    return n;
+}
+
+int usb_async_wait(libusb_context *ctx, USBTransfer *transfer, const Deadline *deadline) {
+    int result = 0;
+    bool cancelling = false;
+    // Never return before the callback has run, otherwise it would later fire on a transfer that has been reused.
+    // That also goes if cancelling fails, e.g. because the transfer has just finished but its callback hasn't run yet.
+    while (!transfer->completed) {
+        if (!cancelling && deadline_expired(deadline)) {
+            (void)usb_async_cancel(transfer);
+            cancelling = true;
+        }
+
+        int err = 0;
+        if (deadline == NULL || cancelling) {
+            err = libusb_handle_events_completed(ctx, &transfer->completed);
+        } else {
+            uint64_t slice_ms = deadline_remaining_ms(deadline);
+            if (slice_ms > USB_ASYNC_POLL_INTERVAL_MS) {
+                slice_ms = USB_ASYNC_POLL_INTERVAL_MS;
+            }
+            struct timeval tv = {.tv_sec = 0, .tv_usec = (long)slice_ms * 1000};
+            err = libusb_handle_events_timeout_completed(ctx, &tv, &transfer->completed);
+        }
+        if (err == 0 || err == LIBUSB_ERROR_INTERRUPTED) {
+            continue;
+        }
+        // Same as libusb's own synchronous API: Give up on the transfer, but keep handling events until it's reaped
+        log_error_libusb("Failed to handle USB events", err);
+        result = -1;
+        if (!cancelling) {
+            (void)usb_async_cancel(transfer);
+            cancelling = true;
+        }
+    }
+    if (transfer->queue != NULL) {
+        usb_async_unlink(transfer->queue, transfer);
+    }
+    return result;
+}
+
+int usb_async_result(const USBTransfer *transfer) {
+    switch (transfer->xfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return LIBUSB_ERROR_INTERRUPTED;
+        case LIBUSB_TRANSFER_ERROR:
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
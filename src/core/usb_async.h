@@ -0,0 +1,151 @@
+#pragma once
+
+#include <libusb.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deadline.h"
+
+// Upper bound on how long the event loop may block before the deadline is re-checked.
+// This is what bounds the latency of deadline_cancel().
+#define USB_ASYNC_POLL_INTERVAL_MS 50
+
+// Size of the frame buffer that comes with every pooled transfer, the same as the HID report size
+#define USB_FRAME_SIZE 64
+
+// Number of transfers preallocated per device
+#define USB_TRANSFER_POOL_SIZE 4
+
+typedef struct USBTransfer USBTransfer;
+typedef struct USBTransferPool USBTransferPool;
+
+// Invoked by usb_async_dispatch() for every transfer popped off a completion queue.
+typedef void (*USBTransferCallback)(USBTransfer *transfer);
+
+// FIFO of transfers libusb has finished with, but which the application has not looked at yet.
+// A queue must only be touched by the thread that handles libusb events for the transfers in it.
+typedef struct {
+    USBTransfer *head;
+    USBTransfer *tail;
+    // Transfers submitted through this queue which haven't completed yet
+    size_t in_flight;
+} USBCompletionQueue;
+
+// An interrupt transfer that's (potentially) in flight.
+struct USBTransfer {
+    struct libusb_transfer *xfer;
+    // Queue the transfer is appended to on completion, may be NULL
+    USBCompletionQueue *queue;
+    USBTransferCallback callback;
+    void *user_data;
+    // Non-zero once libusb is done with the transfer, whether it succeeded or not
+    int completed;
+    USBTransfer *next;
+    // Set for transfers handed out by a pool, which also provides a frame buffer to transfer from/into
+    USBTransferPool *pool;
+    uint8_t *frame;
+    // For transports libusb doesn't handle: File descriptor to transfer through, and point on the monotonic clock
+    // after which the transfer times out
+    int fd;
+    uint64_t expires_at_ms;
+    // Number of times the same data has been (re)submitted, maintained by usb.c
+    unsigned int attempts;
+};
+
+// Fixed set of transfers and frame buffers, reused across operations so that none are allocated at steady state.
+// Like a completion queue, a pool must only be touched by a single thread.
+struct USBTransferPool {
+    USBTransfer transfers[USB_TRANSFER_POOL_SIZE];
+    uint8_t frames[USB_TRANSFER_POOL_SIZE][USB_FRAME_SIZE];
+    // Transfers not handed out at the moment
+    USBTransfer *free_list;
+};
+
+void usb_async_queue_init(USBCompletionQueue *queue);
+
+/*
+ * Allocate a transfer.
+ * Returns NULL on failure.
+ * Error message is obtainable through the log module.
+ */
+USBTransfer *usb_async_alloc(void);
+
+void usb_async_free(USBTransfer *transfer);
+
+/*
+ * Allocate all transfers of the pool up front.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_async_pool_init(USBTransferPool *pool);
+
+// All transfers must have been released before.
+void usb_async_pool_cleanup(USBTransferPool *pool);
+
+/*
+ * Take a transfer out of the pool. Its frame buffer is zeroed.
+ * Returns NULL if all of them are in use.
+ * Error message is obtainable through the log module.
+ */
+USBTransfer *usb_async_pool_acquire(USBTransferPool *pool);
+
+// Hand a transfer back to the pool it came from. It must not be in flight.
+void usb_async_pool_release(USBTransfer *transfer);
+
+/*
+ * Submit an interrupt transfer on the given endpoint without waiting for it to complete.
+ * On completion the transfer is appended to queue (if not NULL).
+ * buf must stay valid until the transfer has completed.
+ * A timeout_ms of 0 means no timeout.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_async_submit(USBCompletionQueue *queue, USBTransfer *transfer, libusb_device_handle *handle,
+                     const unsigned char endpoint, uint8_t *buf, const int buf_len, const unsigned int timeout_ms,
+                     USBTransferCallback callback, void *user_data);
+
+/*
+ * Request cancellation of an in-flight transfer. It still completes (with a cancelled status) through the event loop.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_async_cancel(USBTransfer *transfer);
+
+/*
+ * Mark a transfer as completed and append it to its queue, for transports that don't go through libusb.
+ * The outcome has to be stored in transfer->xfer (status, actual_length) beforehand.
+ */
+void usb_async_complete(USBTransfer *transfer);
+
+/*
+ * Handle pending libusb events, waiting at most timeout_ms for one to arrive.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_async_handle_events(libusb_context *ctx, const int timeout_ms);
+
+/*
+ * Pop the oldest completed transfer off the queue.
+ * Returns NULL if nothing has completed.
+ */
+USBTransfer *usb_async_pop(USBCompletionQueue *queue);
+
+/*
+ * Pop every completed transfer off the queue and run its callback.
+ * Returns the number of transfers dispatched.
+ */
+size_t usb_async_dispatch(USBCompletionQueue *queue);
+
+/*
+ * Run the event loop until the given transfer has completed, then remove it from its queue.
+ * If the deadline expires or is cancelled first, the transfer is cancelled and reaped.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_async_wait(libusb_context *ctx, USBTransfer *transfer, const Deadline *deadline);
+
+/*
+ * Translate the status of a completed transfer into a libusb error code.
+ * Returns 0 if the transfer succeeded.
+ */
+int usb_async_result(const USBTransfer *transfer);
@@ -0,0 +1,236 @@
+#include "usb_hidraw.h"
+
+#include <libusb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include "log.h"
+#include "usb.h"
+
+#ifdef __linux__
+
+#define USB_HIDRAW_SYSFS_DIR "/sys/class/hidraw"
+
+const short USB_HIDRAW_POLL_EVENTS = POLLIN;
+
+// The HID device's parent in sysfs is the USB interface, named "<bus>-<port>.<port>...:<config>.<interface>".
+static bool usb_hidraw_matches(const char *hidraw_name, const char *port_path, const uint8_t iface_num) {
+    char link[PATH_MAX];
+    snprintf(link, sizeof(link), USB_HIDRAW_SYSFS_DIR "/%s/device", hidraw_name);
+    char resolved[PATH_MAX];
+    if (realpath(link, resolved) == NULL) {
+        return false;
+    }
+    // Strip the HID device, leaving the interface
+    char *slash = strrchr(resolved, '/');
+    if (slash == NULL) {
+        return false;
+    }
+    *slash = '\0';
+    slash = strrchr(resolved, '/');
+    const char *iface_name = slash == NULL ? resolved : slash + 1;
+
+    const size_t port_path_len = strlen(port_path);
+    if (strncmp(iface_name, port_path, port_path_len) != 0 || iface_name[port_path_len] != ':') {
+        return false;
+    }
+    const char *dot = strrchr(iface_name + port_path_len, '.');
+    if (dot == NULL) {
+        return false;
+    }
+    char *end = NULL;
+    const unsigned long num = strtoul(dot + 1, &end, 10);
+    return end != dot + 1 && *end == '\0' && num == iface_num;
+}
+
+int usb_hidraw_open(const USBDeviceInfo *info, const uint8_t iface_num) {
+    char port_path[USB_PORT_PATH_STR_LEN];
+    usb_format_port_path(info, port_path, sizeof(port_path));
+
+    DIR *dir = opendir(USB_HIDRAW_SYSFS_DIR);
+    if (dir == NULL) {
+        log_error("Failed to open hidraw node: hidraw is not available");
+        return -1;
+    }
+    char node[PATH_MAX] = {0};
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+        if (strncmp(entry->d_name, "hidraw", strlen("hidraw")) == 0 &&
+            usb_hidraw_matches(entry->d_name, port_path, iface_num)) {
+            snprintf(node, sizeof(node), "/dev/%s", entry->d_name);
+            break;
+        }
+    }
+    closedir(dir);
+    if (node[0] == '\0') {
+        log_error("Failed to open hidraw node: No node belongs to the device");
+        return -1;
+    }
+
+    const int fd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        char msg[PATH_MAX + 64];
+        snprintf(msg, sizeof(msg), "Failed to open hidraw node %s: %s", node, strerror(errno));
+        log_error(msg);
+        return -1;
+    }
+    log_debug("Opened hidraw node");
+    return fd;
+}
+
+void usb_hidraw_close(const int fd) { close(fd); }
+
+static int usb_hidraw_errno_to_libusb(const int err) {
+    switch (err) {
+        case ENODEV:
+        case ENOENT:
+            return LIBUSB_ERROR_NO_DEVICE;
+        case ETIMEDOUT:
+            return LIBUSB_ERROR_TIMEOUT;
+        case EINTR:
+            return LIBUSB_ERROR_INTERRUPTED;
+        case EPIPE:
+            return LIBUSB_ERROR_PIPE;
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+int usb_hidraw_write(const int fd, const uint8_t *buf, const uint8_t buf_len) {
+    // The first byte is the report ID, which U2FHID doesn't use
+    uint8_t report[UINT8_MAX + 1] = {0};
+    memcpy(report + 1, buf, buf_len);  // NOLINT (GCC doesn't support _s)
+    ssize_t n = 0;
+    do {
+        n = write(fd, report, (size_t)buf_len + 1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return usb_hidraw_errno_to_libusb(errno);
+    }
+    return n == 0 ? 0 : (int)n - 1;
+}
+
+int usb_hidraw_read(const int fd, uint8_t *buf, const uint8_t buf_len) {
+    ssize_t n = 0;
+    do {
+        n = read(fd, buf, buf_len);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return usb_hidraw_errno_to_libusb(errno);
+    }
+    return (int)n;
+}
+
+int usb_hidraw_poll(const USBPollFd *fds, bool *ready, const size_t count, const int timeout_ms) {
+    struct pollfd pfds[USB_HIDRAW_MAX_POLL_FDS];
+    const size_t n = count > USB_HIDRAW_MAX_POLL_FDS ? USB_HIDRAW_MAX_POLL_FDS : count;
+    for (size_t i = 0; i < n; i++) {
+        pfds[i].fd = fds[i].fd;
+        pfds[i].events = fds[i].events;
+        pfds[i].revents = 0;
+    }
+    const int err = poll(pfds, (nfds_t)n, timeout_ms);
+    if (err < 0 && errno != EINTR) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Failed to wait for hidraw nodes: %s", strerror(errno));
+        log_error(msg);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        ready[i] = i < n && err > 0 && pfds[i].revents != 0;
+    }
+    return 0;
+}
+
+int usb_hidraw_wake_open(void) {
+    const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Failed to create wake fd: %s", strerror(errno));
+        log_error(msg);
+        return -1;
+    }
+    return fd;
+}
+
+void usb_hidraw_wake_close(const int fd) { close(fd); }
+
+void usb_hidraw_wake(const int fd) {
+    const uint64_t one = 1;
+    ssize_t n = 0;
+    do {
+        n = write(fd, &one, sizeof(one));
+    } while (n < 0 && errno == EINTR);
+    // Only fails if the counter is about to overflow, in which case the fd is readable anyway
+}
+
+void usb_hidraw_wake_drain(const int fd) {
+    uint64_t count = 0;
+    ssize_t n = 0;
+    do {
+        n = read(fd, &count, sizeof(count));
+    } while (n < 0 && errno == EINTR);
+    // Fails with EAGAIN if nobody woke us up, which is fine
+}
+
+#else
+
+const short USB_HIDRAW_POLL_EVENTS = 0;
+
+int usb_hidraw_open(const USBDeviceInfo *info, const uint8_t iface_num) {
+    (void)info;
+    (void)iface_num;
+    log_error("Failed to open hidraw node: hidraw is only available on Linux");
+    return -1;
+}
+
+void usb_hidraw_close(const int fd) { (void)fd; }
+
+int usb_hidraw_write(const int fd, const uint8_t *buf, const uint8_t buf_len) {
+    (void)fd;
+    (void)buf;
+    (void)buf_len;
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int usb_hidraw_read(const int fd, uint8_t *buf, const uint8_t buf_len) {
+    (void)fd;
+    (void)buf;
+    (void)buf_len;
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int usb_hidraw_poll(const USBPollFd *fds, bool *ready, const size_t count, const int timeout_ms) {
+    (void)fds;
+    (void)ready;
+    (void)count;
+    (void)timeout_ms;
+    log_error("Failed to wait for hidraw nodes: hidraw is only available on Linux");
+    return -1;
+}
+
+int usb_hidraw_wake_open(void) { return -1; }
+
+void usb_hidraw_wake_close(const int fd) { (void)fd; }
+
+void usb_hidraw_wake(const int fd) { (void)fd; }
+
+void usb_hidraw_wake_drain(const int fd) { (void)fd; }
+
+#endif
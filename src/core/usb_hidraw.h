@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usb.h"
+
+// Maximum number of hidraw nodes waited on at once
+#define USB_HIDRAW_MAX_POLL 32
+
+// Maximum number of file descriptors waited on at once: The hidraw nodes, libusb's own and the wake fd
+#define USB_HIDRAW_MAX_POLL_FDS (USB_HIDRAW_MAX_POLL + 16 + 1)
+
+// poll() events to watch hidraw nodes for
+extern const short USB_HIDRAW_POLL_EVENTS;
+
+/*
+ * Linux hidraw transport. Talks to the key through the kernel's HID driver (/dev/hidrawN), so neither detaching the
+ * driver nor claiming the interface is needed, and other programs can keep using the key for U2F meanwhile.
+ * On other platforms every function fails.
+ */
+
+/*
+ * Open the hidraw node belonging to the given interface of the device.
+ * Returns the file descriptor, or -1 if there's none (e.g. no permission, or not on Linux).
+ * Error message is obtainable through the log module.
+ */
+int usb_hidraw_open(const USBDeviceInfo *info, const uint8_t iface_num);
+
+void usb_hidraw_close(const int fd);
+
+/*
+ * Send a single report.
+ * Returns the number of bytes sent, or a negative libusb error code on failure.
+ */
+int usb_hidraw_write(const int fd, const uint8_t *buf, const uint8_t buf_len);
+
+/*
+ * Receive a single report without blocking.
+ * Returns the number of bytes received, 0 if no report is available yet, or a negative libusb error code on failure.
+ */
+int usb_hidraw_read(const int fd, uint8_t *buf, const uint8_t buf_len);
+
+/*
+ * Wait at most timeout_ms for any of the file descriptors to get one of its events (or to go away), and flag those
+ * which did. Besides hidraw nodes, these can be libusb's file descriptors and the wake fd, so all of them are waited on
+ * together. At most USB_HIDRAW_MAX_POLL_FDS are waited on, the rest are never flagged.
+ * Returns 0 on success, -1 on failure.
+ * Error message is obtainable through the log module.
+ */
+int usb_hidraw_poll(const USBPollFd *fds, bool *ready, const size_t count, const int timeout_ms);
+
+/*
+ * Create a file descriptor that usb_hidraw_wake() makes readable, for interrupting usb_hidraw_poll() from another
+ * thread. libusb_interrupt_event_handler() can't do that, as libusb doesn't know the poll() is going on.
+ * Returns the file descriptor, or -1 on failure. Not being on Linux isn't logged as an error, as nothing needs waking.
+ * Error message is obtainable through the log module.
+ */
+int usb_hidraw_wake_open(void);
+
+void usb_hidraw_wake_close(const int fd);
+
+// Make the wake fd readable. Safe to call from any thread.
+void usb_hidraw_wake(const int fd);
+
+// Make the wake fd unreadable again, once the wakeup has been noticed.
+void usb_hidraw_wake_drain(const int fd);
@@ -75,7 +75,7 @@ static void do_popup(struct nk_context *ctx) {
 static char NewSerial[HYPERHOTP_SERIAL_LEN + 1] = {0};
 static char NewSeed[HYPERHOTP_SEED_LEN_ASCII + 1] = {0};
 
-static void main_loop(struct nk_context *ctx, nk_bool *running, SDL_Window **win, libusb_device_handle *handle,
+static void main_loop(struct nk_context *ctx, nk_bool *running, SDL_Window **win, USBDevice *dev,
                       FIDOCID cid) {
     /* Input */
     SDL_Event evt;
@@ -93,7 +93,7 @@ static void main_loop(struct nk_context *ctx, nk_bool *running, SDL_Window **win
         // Display information about the device
         nk_layout_row_dynamic(ctx, 0, 2);
         char serial[HYPERHOTP_SERIAL_LEN] = {0};
-        const int programmed = hyperhotp_check_programmed(handle, cid, serial);
+        const int programmed = hyperhotp_check_programmed(dev, cid, serial, NULL);
         if (programmed) {
             nk_label(ctx, "Programmed: YES", NK_LEFT);
         } else {
@@ -109,7 +109,7 @@ static void main_loop(struct nk_context *ctx, nk_bool *running, SDL_Window **win
         if (disableable_button(ctx, "Reset", programmed)) {
             popup(ctx, "Reset", "Press button on device!");  // TODO: Short-circuit code on first execution here, so
                                                              // popup is shown before blocking on button press
-            if (hyperhotp_reset(handle, cid) == 0) {
+            if (hyperhotp_reset(dev, cid, NULL) == 0) {
                 popup(ctx, "Reset", "OK!");
                 printf("Reset complete!\n");
             } else {
@@ -136,7 +136,7 @@ static void main_loop(struct nk_context *ctx, nk_bool *running, SDL_Window **win
         if (disableable_button(ctx, "Program", programming_enabled)) {
             popup(ctx, "Program", "Press button on device!");  // TODO: Short-circuit code on first execution here, so
                                                                // popup is shown before blocking on button press
-            const int err = hyperhotp_program(handle, cid, true, NewSerial, NewSeed);
+            const int err = hyperhotp_program(dev, cid, true, NewSerial, NewSeed, NULL);
             if (err != 0) {
                 char *err_str = log_get_last_error_string();
                 fprintf(stderr, "Failed to program device, error message: %s\n", err_str);
@@ -198,17 +198,24 @@ int main(int argc, char *argv[]) {
     nk_style_set_font(ctx, &proggy->handle);
 
     // USB device init
-    libusb_device_handle *handle = NULL;
+    USBContext *usb_ctx = NULL;
+    USBDevice *dev = NULL;
     FIDOCID cid;
     // TODO: Notify user graphically of error
-    int err = hyperhotp_init(&handle, cid);
+    int err = hyperhotp_context_init(&usb_ctx);
+    if (err == 0) {
+        err = hyperhotp_init(usb_ctx, &dev, cid, NULL);
+    }
     if (err != 0) {
         char *msg = log_get_last_error_string();
         log_fatal(msg);
         log_free_error_string(msg);
     }
 
-    while (running) main_loop(ctx, &running, &win, handle, cid);
+    while (running) main_loop(ctx, &running, &win, dev, cid);
+
+    hyperhotp_cleanup(dev);
+    hyperhotp_context_cleanup(usb_ctx);
 
     nk_font_atlas_cleanup(atlas);
     nk_sdl_shutdown();